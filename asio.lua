@@ -1,13 +1,19 @@
 -- Copyright (C) by Jianhao Zhang (heeroz)
 
+local MODULE_NAME = ...
+
 local co_create = coroutine.create
 local co_status = coroutine.status
 local yield = coroutine.yield
 local resume = coroutine.resume
 local running = coroutine.running
 local setmetatable = setmetatable
+local getmetatable = getmetatable
+local newproxy = newproxy
 local type = type
+local pairs = pairs
 local tostring = tostring
+local tonumber = tonumber
 local assert = assert
 
 local ok, new_table = pcall(require, "table.new")
@@ -26,33 +32,109 @@ assert(asio_c, 'load c lib failed.')
 local C = ffi.C
 
 ffi.cdef[[
+    typedef struct asio_loop asio_loop;
+    typedef uint64_t conn_handle;
+    asio_loop* asio_new_loop();
+    void asio_delete_loop(asio_loop* loop);
     typedef struct event_message_for_ffi {
         char type;
         int dest_id;
+        int err;
         void* source;
         const char* data;
         size_t data_len;
     } event_message;
-    event_message* asio_get(int wait_sec);
-    bool asio_stopped();
-    void asio_sleep(int dest_id, double sec);
-
-    void* asio_new_connect(const char* host, unsigned short port,
-        int dest_id, bool v6);
-    void* asio_new_connect_sockaddr(const char* p, int dest_id);
-    void asio_delete_connection(void* p);
-    void asio_conn_read(void* p, size_t size, int dest_id);
-    void asio_conn_read_some(void* p, int dest_id);
-    void asio_conn_write(void* p, const char* data, size_t size,
-        int dest_id);
-    void asio_conn_close(void* p);
-    void* asio_get_original_dst(void* p);
-    const char* asio_addr_to_str(const char* p);
-
-    void* asio_new_server(const char* ip, int port);
+    int asio_get_batch(asio_loop* loop, event_message* events, int max,
+        int wait_sec);
+    typedef struct event_stats_for_ffi {
+        size_t queued;
+        size_t capacity;
+        size_t high_watermark;
+        size_t overflows;
+        uint64_t reads;
+        uint64_t read_bytes;
+        uint64_t accepts;
+        uint64_t accept_wakeups;
+        size_t buffers;
+        uint64_t handler_allocs;
+        uint64_t handler_heap_allocs;
+    } event_stats;
+    void asio_get_stats(asio_loop* loop, event_stats* rtn);
+    bool asio_stopped(asio_loop* loop);
+    const char* asio_strerror(asio_loop* loop, int code);
+    typedef struct error_const_for_ffi {
+        const char* name;
+        int code;
+    } error_const;
+    const error_const* asio_error_consts(int* count);
+    void asio_sleep(asio_loop* loop, int dest_id, double sec);
+
+    conn_handle asio_new_connect(asio_loop* loop, const char* host,
+        unsigned short port, int dest_id, bool v6, double timeout);
+    conn_handle asio_new_connect_sockaddr(asio_loop* loop, const char* p,
+        int dest_id, double timeout);
+    void asio_delete_connection(asio_loop* loop, conn_handle h);
+    bool asio_conn_read(asio_loop* loop, conn_handle h, size_t size,
+        int dest_id, double timeout, event_message* out);
+    bool asio_conn_read_some(asio_loop* loop, conn_handle h, int dest_id,
+        double timeout, event_message* out);
+    bool asio_conn_read_until(asio_loop* loop, conn_handle h,
+        const char* delim, size_t delim_len, size_t max, int dest_id,
+        double timeout, event_message* out);
+    void asio_conn_set_read_ahead(asio_loop* loop, conn_handle h, size_t size);
+    void asio_conn_set_read_size(asio_loop* loop, conn_handle h, size_t min,
+        size_t max);
+    void asio_conn_set_read_wait(asio_loop* loop, conn_handle h, bool on);
+    bool asio_conn_add_transform(asio_loop* loop, conn_handle h, bool write,
+        const char* kind, const char* key, size_t key_len, const char* iv,
+        size_t iv_len);
+    void asio_conn_set_aead(asio_loop* loop, conn_handle h,
+        const char* send_key, const char* recv_key);
+    bool asio_conn_read_frame(asio_loop* loop, conn_handle h, int dest_id,
+        double timeout, event_message* out);
+    int asio_conn_write_frame(asio_loop* loop, conn_handle h, const char* data,
+        size_t size, int dest_id, double timeout);
+    int asio_conn_write(asio_loop* loop, conn_handle h, const char* data,
+        size_t size, int dest_id, double timeout);
+    int asio_conn_write_buf(asio_loop* loop, conn_handle h, const void* data,
+        size_t size, int dest_id, double timeout);
+    int asio_conn_writev(asio_loop* loop, conn_handle h, const char** datas,
+        const size_t* sizes, int count, int dest_id, double timeout);
+    void asio_conn_set_pipelined(asio_loop* loop, conn_handle h, bool on,
+        size_t high_watermark);
+    int asio_conn_flush(asio_loop* loop, conn_handle h, int dest_id,
+        double timeout);
+    void asio_forward(asio_loop* loop, conn_handle a, conn_handle b,
+        bool both, int dest_id);
+    void asio_conn_close(asio_loop* loop, conn_handle h);
+    int asio_conn_setopt(asio_loop* loop, conn_handle h, const char* name,
+        int value);
+    void* asio_get_original_dst(asio_loop* loop, conn_handle h);
+    const char* asio_addr_to_str(asio_loop* loop, const char* p);
+
+    void* asio_channel_open(const char* name, size_t capacity);
+    void asio_channel_detach(asio_loop* loop, void* p);
+    int asio_channel_send(void* p, const char* data, size_t size);
+    int asio_channel_send_conn(asio_loop* loop, void* p, conn_handle h);
+    bool asio_channel_recv(asio_loop* loop, void* p, int dest_id,
+        event_message* out);
+
+    void* asio_new_server(asio_loop* loop, const char* ip, int port);
+    bool asio_server_setopt(void* p, const char* name, int value);
+    typedef struct worker_pool worker_pool;
+    worker_pool* asio_new_workers(asio_loop* loop, const char* ip, int port);
+    bool asio_workers_setopt(worker_pool* p, const char* name, int value);
+    bool asio_workers_start(worker_pool* p, int count, const char* boot,
+        size_t boot_len, const char** args, const size_t* arg_lens,
+        int nargs);
+    void asio_delete_workers(worker_pool* p);
     void asio_delete_server(void* p);
 ]]
 
+-- Every call goes through this state's own loop. Connections and servers
+-- may be collected after it when the state closes, so it is never freed.
+local loop = asio_c.asio_new_loop()
+
 ------------------thread------------------------
 
 local _M = {}
@@ -120,6 +202,22 @@ function _M.spawn_light_thread(func, ...)
     return th
 end
 
+------------------error------------------------
+
+-- Errors are numeric codes, compare them with the constants below
+-- (asio.EOF, asio.ECONNRESET, ...), asio.strerror(code) formats a message.
+do
+    local count = ffi.new('int[1]')
+    local consts = asio_c.asio_error_consts(count)
+    for i = 0, count[0] - 1 do
+        _M[ffi.string(consts[i].name)] = consts[i].code
+    end
+end
+
+function _M.strerror(code)
+    return ffi.string(asio_c.asio_strerror(loop, code))
+end
+
 ------------------connection------------------------
 
 local conn_M = {}
@@ -127,57 +225,292 @@ conn_M.__index = conn_M
 
 local sockaddr_size = 128
 
+-- Reads served from the connection's buffer complete at once and fill
+-- `sync_evt`; otherwise the light thread waits for the completion event.
+local sync_evt = ffi.new('event_message')
+
+local function _wait(done)
+    if done then
+        return sync_evt.err, sync_evt.data, sync_evt.data_len
+    end
+    return yield()
+end
+
+-- Writes return the error code when they completed at once, -1 to wait.
+local function _wait_write(rc)
+    if rc < 0 then
+        return yield()
+    end
+    return rc
+end
+
 function conn_M:get_original_dst(data)
-    local addr = asio_c.asio_get_original_dst(self.cpoint)
+    local addr = asio_c.asio_get_original_dst(loop, self.handle)
     if addr == nil then return nil end
     return ffi.string(addr, sockaddr_size)
 end
 
-function conn_M:read(n)
+function conn_M:read(n, timeout)
     local th = running()
     assert(th, 'need be called in light thread.')
-    asio_c.asio_conn_read(self.cpoint, n, th_to_id[th])
-    local ok, data = yield()
-    if ok then
-        return data
+    local err, data, len = _wait(asio_c.asio_conn_read(loop, self.handle, n,
+        th_to_id[th], timeout or 0, sync_evt))
+    if err == 0 then
+        return ffi.string(data, len)
+    else
+        return nil, err
+    end
+end
+
+-- Same as read(), but returns a `const char*` view into the connection's
+-- buffer and its length. The view is valid until the next operation on conn
+-- or until the light thread yields again.
+function conn_M:read_view(n, timeout)
+    local th = running()
+    assert(th, 'need be called in light thread.')
+    local err, data, len = _wait(asio_c.asio_conn_read(loop, self.handle, n,
+        th_to_id[th], timeout or 0, sync_evt))
+    if err == 0 then
+        return data, len
     else
-        return nil, data
+        return nil, err
     end
 end
 
-function conn_M:read_some()
+function conn_M:read_some(timeout)
     local th = running()
     assert(th, 'need be called in light thread.')
-    asio_c.asio_conn_read_some(self.cpoint, th_to_id[th])
-    local ok, data = yield()
-    if ok then
+    local err, data, len = _wait(asio_c.asio_conn_read_some(loop, self.handle,
+        th_to_id[th], timeout or 0, sync_evt))
+    data = ffi.string(data, len)
+    if err == 0 then
         return data
     else
-        local ok, err = yield()
         return data, err
     end
 end
 
-function conn_M:write(data)
+function conn_M:read_some_view(timeout)
+    local th = running()
+    assert(th, 'need be called in light thread.')
+    local err, data, len = _wait(asio_c.asio_conn_read_some(loop, self.handle,
+        th_to_id[th], timeout or 0, sync_evt))
+    if err == 0 then
+        return data, len
+    else
+        return data, len, err
+    end
+end
+
+local READ_UNTIL_MAX = 65536
+
+function conn_M:read_until(delim, max, timeout)
+    assert(delim and #delim > 0)
+    local th = running()
+    assert(th, 'need be called in light thread.')
+    local err, data, len = _wait(asio_c.asio_conn_read_until(loop, self.handle,
+        delim, #delim, max or READ_UNTIL_MAX, th_to_id[th], timeout or 0,
+        sync_evt))
+    if err == 0 then
+        return ffi.string(data, len)
+    else
+        return nil, err
+    end
+end
+
+-- read_some, read_until and read_frame read as much as is available into a
+-- buffer that adapts to the traffic between min and max bytes.
+function conn_M:set_read_size(min, max)
+    assert(min > 0 and min <= max, 'need 0 < min <= max')
+    asio_c.asio_conn_set_read_size(loop, self.handle, min, max)
+end
+
+-- In read-wait mode read_some, read_until and read_frame hold no buffer
+-- while they wait for data, for large numbers of idle connections.
+function conn_M:set_read_wait(on)
+    asio_c.asio_conn_set_read_wait(loop, self.handle, on and true or false)
+end
+
+-- With read-ahead on, reads pull in up to `size` bytes at once and later
+-- reads are served from that buffer without yielding. 0 turns it off.
+function conn_M:set_read_ahead(size)
+    asio_c.asio_conn_set_read_ahead(loop, self.handle, size or 0)
+end
+
+-- Appends a transform to the 'read' or 'write' side of conn. Every byte
+-- received or sent from now on passes through it, in C. kind is 'xor',
+-- 'aes-256-cfb' or 'aes-256-ctr'; the AES ones take a 32-byte key and a
+-- 16-byte iv.
+function conn_M:add_transform(side, kind, key, iv)
+    assert(side == 'read' or side == 'write', 'side must be read or write')
+    iv = iv or ''
+    local ok = asio_c.asio_conn_add_transform(loop, self.handle,
+        side == 'write', kind, key, #key, iv, #iv)
+    assert(ok, 'invalid transform ' .. tostring(kind))
+    return true
+end
+
+-- Frames are sealed with ChaCha20-Poly1305 under 32-byte keys, one for
+-- each direction. Every key must be used by one connection only.
+function conn_M:set_aead(send_key, recv_key)
+    assert(#send_key == 32 and #recv_key == 32, 'keys must be 32 bytes')
+    asio_c.asio_conn_set_aead(loop, self.handle, send_key, recv_key)
+end
+
+-- Returns the payload of the next frame, asio.EBADMSG if it was forged.
+function conn_M:read_frame(timeout)
+    local th = running()
+    assert(th, 'need be called in light thread.')
+    local err, data, len = _wait(asio_c.asio_conn_read_frame(loop, self.handle,
+        th_to_id[th], timeout or 0, sync_evt))
+    if err == 0 then
+        return ffi.string(data, len)
+    else
+        return nil, err
+    end
+end
+
+function conn_M:write_frame(data, timeout)
     assert(data and #data > 0)
     local th = running()
     assert(th, 'need be called in light thread.')
-    asio_c.asio_conn_write(self.cpoint, data, #data, th_to_id[th])
-    local ok, err_msg = yield()
-    if ok then
+    local err = _wait_write(asio_c.asio_conn_write_frame(loop, self.handle,
+        data, #data, th_to_id[th], timeout or 0))
+    if err == 0 then
+        return true
+    else
+        return nil, err
+    end
+end
+
+function conn_M:write(data, timeout)
+    assert(data and #data > 0)
+    local th = running()
+    assert(th, 'need be called in light thread.')
+    local err = _wait_write(asio_c.asio_conn_write(loop, self.handle, data,
+        #data, th_to_id[th], timeout or 0))
+    if err == 0 then
+        return true
+    else
+        return nil, err
+    end
+end
+
+-- Writes `size` bytes at `ptr`(cdata) without copying them. Always waits
+-- until they are written, the caller keeps the memory alive meanwhile.
+function conn_M:write_buf(ptr, size, timeout)
+    assert(ptr ~= nil and size > 0)
+    local th = running()
+    assert(th, 'need be called in light thread.')
+    local err = _wait_write(asio_c.asio_conn_write_buf(loop, self.handle, ptr,
+        size, th_to_id[th], timeout or 0))
+    if err == 0 then
+        return true
+    else
+        return nil, err
+    end
+end
+
+local writev_max = 16
+local writev_datas = ffi.new('const char*[?]', writev_max)
+local writev_sizes = ffi.new('size_t[?]', writev_max)
+
+-- Sends all strings of `pieces` in one gather write with one completion.
+-- Outside of pipelined mode the strings are not copied, `pieces` keeps them
+-- alive meanwhile.
+function conn_M:writev(pieces, timeout)
+    local n = #pieces
+    assert(n > 0)
+    local th = running()
+    assert(th, 'need be called in light thread.')
+    if n > writev_max then
+        writev_max = n
+        writev_datas = ffi.new('const char*[?]', n)
+        writev_sizes = ffi.new('size_t[?]', n)
+    end
+    for i = 1, n do
+        local piece = pieces[i]
+        writev_datas[i - 1] = piece
+        writev_sizes[i - 1] = #piece
+    end
+    local err = _wait_write(asio_c.asio_conn_writev(loop, self.handle,
+        writev_datas, writev_sizes, n, th_to_id[th], timeout or 0))
+    if err == 0 then
+        return true
+    else
+        return nil, err
+    end
+end
+
+-- In pipelined mode writes are queued, coalesced and return at once unless
+-- more than `high_watermark` bytes are waiting. Pass nil to turn it off.
+function conn_M:set_pipelined(high_watermark)
+    asio_c.asio_conn_set_pipelined(loop, self.handle, high_watermark ~= nil,
+        high_watermark or 0)
+end
+
+function conn_M:flush(timeout)
+    local th = running()
+    assert(th, 'need be called in light thread.')
+    local err = _wait_write(asio_c.asio_conn_flush(loop, self.handle,
+        th_to_id[th], timeout or 0))
+    if err == 0 then
         return true
     else
-        return nil, err_msg
+        return nil, err
+    end
+end
+
+-- Relays everything read from conn to `other` inside C, until conn's read
+-- side ends. Returns the bytes relayed and the error, nil on end of file.
+function conn_M:pipe_to(other)
+    local th = running()
+    assert(th, 'need be called in light thread.')
+    asio_c.asio_forward(loop, self.handle, other.handle, false, th_to_id[th])
+    local err, data = yield()
+    local bytes = ffi.cast('const uint64_t*', data)
+    return tonumber(bytes[0]), err ~= 0 and err or nil
+end
+
+local function _opt_value(value)
+    if value == true then return 1 end
+    if not value then return 0 end
+    return value
+end
+
+-- Sets a TCP option: 'nodelay', 'sndbuf', 'rcvbuf', 'keepalive',
+-- 'keepalive_idle', 'keepalive_interval', 'keepalive_count', 'quickack',
+-- 'cork' or 'notsent_lowat'. value is a number or a boolean.
+function conn_M:setopt(name, value)
+    local err = asio_c.asio_conn_setopt(loop, self.handle, name,
+        _opt_value(value))
+    assert(err >= 0, 'unknown option ' .. tostring(name))
+    if err == 0 then
+        return true
+    else
+        return nil, err
     end
 end
 
 function conn_M:close()
-    asio_c.asio_conn_close(self.cpoint)
-    self.cpoint = nil
+    asio_c.asio_conn_close(loop, self.handle)
+    asio_c.asio_delete_connection(loop, self.handle)
+    self.handle = 0
     setmetatable(self, nil)
-    self.read       = function() return nil, 'Already closed.' end
+    self.read       = function() return nil, _M.EBADF end
+    self.read_view  = self.read
     self.read_some  = self.read
+    self.read_some_view = self.read
+    self.read_until = self.read
+    self.read_frame = self.read
+    self.write_frame = self.read
     self.write      = self.read
+    self.writev     = self.read
+    self.write_buf  = self.read
+    self.pipe_to    = self.read
+    self.add_transform = self.read
+    self.setopt     = self.read
+    self.flush      = self.read
     self.close      = function() end
 end
 
@@ -210,7 +543,7 @@ end
 -- function _M:receive()
 --     local th = running()
 --     assert(th, 'need be called in light thread.')
---     asio_c.asio_udp_receive(self.cpoint, n, th_to_id[th])
+--     asio_c.asio_udp_receive(self.handle, n, th_to_id[th])
 --     local ok, data = yield()
 --     if ok then
 --         return data
@@ -223,7 +556,7 @@ end
 --     assert(data and #data > 0)
 --     local th = running()
 --     assert(th, 'need be called in light thread.')
---     asio_c.asio_conn_write(self.cpoint, data, #data, th_to_id[th])
+--     asio_c.asio_conn_write(self.handle, data, #data, th_to_id[th])
 --     local ok, err_msg = yield()
 --     if ok then
 --         return true
@@ -236,31 +569,48 @@ end
 
 local EVT_ACCEPT = 1
 local EVT_CONTINUE = 2
+local EVT_ACCEPT_BATCH = 3
 
 local handler_tbl = {}
 
-local function _make_connection(cpoint)
-    local con = {
-        cpoint = ffi.gc(cpoint, asio_c.asio_delete_connection),
-    }
+-- A connection is an integer handle into the C handle table. The proxy
+-- frees the handle once con is collected, unless close() or a channel
+-- already did and set it to the invalid handle 0.
+local function _make_connection(handle)
+    local con = { handle = tonumber(handle) }
+    con.gc = newproxy(true)
+    getmetatable(con.gc).__gc = function()
+        if con.handle ~= 0 then
+            asio_c.asio_delete_connection(loop, con.handle)
+        end
+    end
     setmetatable(con, conn_M)
     return con
 end
 
+local function _handle_at(data, i)
+    return ffi.cast('const conn_handle*', data)[i]
+end
+
 local function _evt_disp(evt)
     if evt.type == EVT_ACCEPT then
 
         local handler = handler_tbl[evt.dest_id]
-        local con = _make_connection(evt.source)
+        local con = _make_connection(_handle_at(evt.data, 0))
         handler(con)
 
+    elseif evt.type == EVT_ACCEPT_BATCH then
+
+        local handler = handler_tbl[evt.dest_id]
+        for i = 0, tonumber(evt.data_len) / 8 - 1 do
+            handler(_make_connection(_handle_at(evt.data, i)))
+        end
+
     elseif evt.type == EVT_CONTINUE then
 
         local th = th_tbl[evt.dest_id]
-        local source = evt.source ~= nil and evt.source or nil
-        local data = ffi.string(evt.data, evt.data_len)
-
-        local ok, err = resume(th, source, data)
+        local ok, err = resume(th, evt.err, evt.data, evt.data_len,
+            evt.source)
         if not ok then
             print( debug.traceback( th, err ))
         end
@@ -268,67 +618,239 @@ local function _evt_disp(evt)
     end
 end
 
-function _M.connect(host, port, resolve_v6)
+function _M.connect(host, port, resolve_v6, timeout, opts)
     if type(port) == 'string' then
         port = tonumber(port)
     end
     local th = running()
     assert(th, 'need be called in light thread.')
-    local cpoint
+    local handle
     if port == nil and #host >= 64 then
-        cpoint = asio_c.asio_new_connect_sockaddr(host, th_to_id[th])
+        handle = asio_c.asio_new_connect_sockaddr(loop, host, th_to_id[th],
+            timeout or 0)
     else
-        cpoint = asio_c.asio_new_connect(host, port, th_to_id[th],
-            resolve_v6 and true or false)
+        handle = asio_c.asio_new_connect(loop, host, port, th_to_id[th],
+            resolve_v6 and true or false, timeout or 0)
+    end
+    local con = _make_connection(handle)
+    local err = yield()
+    if err ~= 0 then return nil, err end
+    for name, value in pairs(opts or {}) do
+        local ok, err = con:setopt(name, value)
+        if not ok then
+            con:close()
+            return nil, err
+        end
     end
-    local con = _make_connection(cpoint)
-    local ok, msg = yield()
-    if ok == nil then return nil, msg end
     return con
 end
 
+-- Relays both directions between a and b inside C. When either side ends
+-- both are closed. Returns the bytes a->b, b->a and the error, nil on
+-- end of file.
+function _M.forward(a, b)
+    local th = running()
+    assert(th, 'need be called in light thread.')
+    asio_c.asio_forward(loop, a.handle, b.handle, true, th_to_id[th])
+    local err, data = yield()
+    local bytes = ffi.cast('const uint64_t*', data)
+    return tonumber(bytes[0]), tonumber(bytes[1]), err ~= 0 and err or nil
+end
+
 function _M.addr_to_str(addr)
     assert(#addr >= 64)
-    return ffi.string(asio_c.asio_addr_to_str(addr))
+    return ffi.string(asio_c.asio_addr_to_str(loop, addr))
 end
 
-function _M.server(ip, port, accept_handler)
+------------------channel------------------------
+
+local chan_M = {}
+chan_M.__index = chan_M
+
+local channels = {}
+
+-- A channel of that name, shared by every Lua state of the process (e.g.
+-- the threads of a server). Any state sends, one state at a time receives.
+-- `capacity` (default 1024) counts when the channel is created.
+function _M.channel(name, capacity)
+    local ch = channels[name]
+    if ch then
+        return ch
+    end
+    local c = asio_c.asio_channel_open(name, capacity or 1024)
+    local gc = newproxy(true)
+    getmetatable(gc).__gc = function()
+        asio_c.asio_channel_detach(loop, c)
+    end
+    ch = setmetatable({ c = c, gc = gc }, chan_M)
+    channels[name] = ch
+    return ch
+end
+
+-- Sends a string or a connection without blocking. A connection moves to
+-- the receiving state and can no longer be used here.
+function chan_M:send(msg)
+    local err
+    if type(msg) == 'table' then
+        err = asio_c.asio_channel_send_conn(loop, self.c, msg.handle)
+        if err == 0 then
+            msg.handle = 0
+        end
+    else
+        err = asio_c.asio_channel_send(self.c, msg, #msg)
+    end
+    if err == 0 then
+        return true
+    end
+    return nil, err
+end
+
+-- Returns the next string or connection, waiting for one when empty.
+function chan_M:recv()
+    local th = running()
+    assert(th, 'need be called in light thread.')
+    local err, data, len, source
+    if asio_c.asio_channel_recv(loop, self.c, th_to_id[th], sync_evt) then
+        err, data, len, source = sync_evt.err, sync_evt.data,
+            sync_evt.data_len, sync_evt.source
+    else
+        err, data, len, source = yield()
+    end
+    if err ~= 0 then
+        return nil, err
+    end
+    if source ~= nil then
+        return _make_connection(_handle_at(data, 0))
+    end
+    return ffi.string(data, len)
+end
+
+-- Runs in the fresh Lua state of every worker thread of a server.
+local WORKER_BOOT = [[
+local name, path, cpath, port, handler, loop = ...
+package.path, package.cpath = path, cpath
+require(name)._worker_main(tonumber(port), handler, loop)
+]]
+
+-- `addr` is the loop of the worker thread, which owns it.
+function _M._worker_main(port, handler, addr)
+    asio_c.asio_delete_loop(loop)
+    loop = ffi.cast('asio_loop*', tonumber(addr))
+    handler_tbl[port] = assert(loadstring(handler))
+    _M.run()
+end
+
+local function _new_workers(ip, port, accept_handler, opts)
+    local pool = asio_c.asio_new_workers(loop, ip, port)
+    if pool == nil then
+        return nil
+    end
+    for name, value in pairs(opts) do
+        local ok = name == 'threads' or
+            asio_c.asio_workers_setopt(pool, name, _opt_value(value))
+        if not ok then
+            asio_c.asio_delete_workers(pool)
+            error('unknown option ' .. tostring(name))
+        end
+    end
+    local args = { MODULE_NAME, package.path, package.cpath, tostring(port),
+        string.dump(accept_handler) }
+    local datas = ffi.new('const char*[?]', #args, args)
+    local sizes = ffi.new('size_t[?]', #args)
+    for i = 1, #args do
+        sizes[i - 1] = #args[i]
+    end
+    if not asio_c.asio_workers_start(pool, opts.threads, WORKER_BOOT,
+        #WORKER_BOOT, datas, sizes, #args) then
+        asio_c.asio_delete_workers(pool)
+        return nil
+    end
+    return ffi.gc(pool, asio_c.asio_delete_workers)
+end
+
+-- `opts` are socket options (see conn:setopt) for every accepted conn, and
+-- `threads`: how many threads, each with its own Lua state, serve the port.
+function _M.server(ip, port, accept_handler, opts)
+    if opts and opts.threads and opts.threads > 1 then
+        local upvalue = debug.getupvalue(accept_handler, 1)
+        if upvalue then
+            error('accept_handler of a threaded server runs in other Lua '
+                .. 'states and cannot use the upvalue ' .. upvalue, 2)
+        end
+        return _new_workers(ip, port, accept_handler, opts)
+    end
     handler_tbl[port] = accept_handler
-    local sv = asio_c.asio_new_server(ip, port)
+    local sv = asio_c.asio_new_server(loop, ip, port)
     if sv == nil then
         return nil
-    else
-        return ffi.gc(sv, asio_c.asio_delete_server)
     end
+    for name, value in pairs(opts or {}) do
+        local ok = name == 'threads' or
+            asio_c.asio_server_setopt(sv, name, _opt_value(value))
+        if not ok then
+            asio_c.asio_delete_server(sv)
+            error('unknown option ' .. tostring(name))
+        end
+    end
+    return ffi.gc(sv, asio_c.asio_delete_server)
 end
 
 function _M.destory_server(server_holder)
-    asio_c.asio_delete_server(ffi.gc(server_holder, nil))
+    if ffi.istype('worker_pool*', server_holder) then
+        asio_c.asio_delete_workers(ffi.gc(server_holder, nil))
+    else
+        asio_c.asio_delete_server(ffi.gc(server_holder, nil))
+    end
 end
 
 function _M.sleep(sec)
     local th = running()
     assert(th, 'need be called in light thread.')
-    asio_c.asio_sleep(th_to_id[th], sec)
+    asio_c.asio_sleep(loop, th_to_id[th], sec)
     yield()
     return
 end
 
+local MAX_BATCH = 256
+local evt_batch = ffi.new('event_message[?]', MAX_BATCH)
+
+local function _drain(wait_sec)
+    local n = asio_c.asio_get_batch(loop, evt_batch, MAX_BATCH, wait_sec)
+    for i = 0, n - 1 do
+        _evt_disp(evt_batch[i])
+    end
+    return n
+end
+
 function _M.run()
     while true do
-        local evt = asio_c.asio_get(-1)
-        if evt ~= nil then
-            _evt_disp(evt)
-        end
-        if asio_c.asio_stopped() then break end
+        if _drain(-1) == 0 and asio_c.asio_stopped(loop) then break end
     end
 end
 
 function _M.run_once(wait_sec)
-    local evt = asio_c.asio_get(wait_sec or -1)
-    if evt ~= nil then
-        _evt_disp(evt)
-    end
+    _drain(wait_sec or -1)
+end
+
+local stats_buf = ffi.new('event_stats')
+
+function _M.stats()
+    asio_c.asio_get_stats(loop, stats_buf)
+    return {
+        queued          = tonumber(stats_buf.queued),
+        capacity        = tonumber(stats_buf.capacity),
+        high_watermark  = tonumber(stats_buf.high_watermark),
+        overflows       = tonumber(stats_buf.overflows),
+        reads           = tonumber(stats_buf.reads),
+        read_bytes      = tonumber(stats_buf.read_bytes),
+        avg_read_bytes  = tonumber(stats_buf.read_bytes) /
+            math.max(tonumber(stats_buf.reads), 1),
+        accepts         = tonumber(stats_buf.accepts),
+        accept_wakeups  = tonumber(stats_buf.accept_wakeups),
+        buffers         = tonumber(stats_buf.buffers),
+        handler_allocs  = tonumber(stats_buf.handler_allocs),
+        handler_heap_allocs = tonumber(stats_buf.handler_heap_allocs),
+    }
 end
 
 return _M
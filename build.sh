@@ -1 +1 @@
-gcc -g -O3 -shared -std=c++11 -fPIC -I./include luaAsio.cpp -lstdc++ -lpthread -o libasio.so 
\ No newline at end of file
+gcc -g -O3 -shared -std=c++11 -fPIC -I./include luaAsio.cpp -lstdc++ -lpthread -ldl -o libasio.so 
\ No newline at end of file
@@ -1,2 +1,2 @@
-arm-linux-gnueabi-gcc -g -O3 -shared -std=c++11 -fPIC -D_ARM -I./include luaAsio.cpp -lstdc++ -lpthread -o libasio.so 
+arm-linux-gnueabi-gcc -g -O3 -shared -std=c++11 -fPIC -D_ARM -I./include luaAsio.cpp -lstdc++ -lpthread -ldl -o libasio.so 
 
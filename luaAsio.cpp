@@ -16,225 +16,3197 @@
 #   define ASIO_DISABLE_STD_FUTURE
 #endif
 
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <deque>
+#include <vector>
 #include <map>
 #include <iostream>
+#include <memory>
 #include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include <asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/intrusive_ptr.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define LUAASIO_X86
+#   define TARGET_SSE2 __attribute__((target("sse2")))
+#   define TARGET_AVX2 __attribute__((target("avx2")))
+#   define TARGET_AESNI __attribute__((target("aes,sse2")))
+#   include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#   define LUAASIO_X86
+#   define TARGET_SSE2
+#   define TARGET_AVX2
+#   define TARGET_AESNI
+#   include <intrin.h>
+#   include <immintrin.h>
+#endif
 using asio::ip::tcp;
 using asio::ip::udp;
 using namespace std;
 
 #ifndef _WINDOWS
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <dlfcn.h>
 #   include <linux/netfilter_ipv4.h>
 //# include <linux/netfilter_ipv6/ip6_tables.h>
 #   define IP6T_SO_ORIGINAL_DST            80
 #endif
 
+//----------------------buffer pool--------------------------
+
+// Refcounted buffer for read and send data. Buffers of the pooled sizes go
+// back to buffer_pool instead of the heap when the last reference drops.
+class buffer_pool;
+
+struct pool_buffer {
+    buffer_pool* pool;
+    int refs;
+    int size_class;
+    size_t capacity;
+    pool_buffer* next_free;
+
+    char* data() { return (char*)(this + 1); }
+};
+
+class buffer_pool
+{
+public:
+    size_t in_use = 0;
+
+    ~buffer_pool() {
+        for (auto head : _free) {
+            while (head) {
+                auto next = head->next_free;
+                free(head);
+                head = next;
+            }
+        }
+    }
+
+    pool_buffer* acquire(size_t size) {
+        int size_class = 0;
+        while (size_class < CLASSES && CLASS_SIZE[size_class] < size)
+            ++size_class;
+        pool_buffer* buf;
+        if (size_class < CLASSES && _free[size_class]) {
+            buf = _free[size_class];
+            _free[size_class] = buf->next_free;
+            --_free_count[size_class];
+        } else {
+            size_t capacity = size_class < CLASSES ?
+                CLASS_SIZE[size_class] : size;
+            buf = (pool_buffer*)malloc(sizeof(pool_buffer) + capacity);
+            if (!buf) throw std::bad_alloc();
+            buf->size_class = size_class < CLASSES ? size_class : -1;
+            buf->capacity = capacity;
+        }
+        buf->pool = this;
+        buf->refs = 0;
+        ++in_use;
+        return buf;
+    }
+
+    void recycle(pool_buffer* buf) {
+        int size_class = buf->size_class;
+        --in_use;
+        if (size_class < 0 || _free_count[size_class] >= max_free(size_class))
+        {
+            free(buf);
+            return;
+        }
+        buf->next_free = _free[size_class];
+        _free[size_class] = buf;
+        ++_free_count[size_class];
+    }
+
+private:
+    static const int CLASSES = 5;
+    static const size_t CLASS_SIZE[CLASSES];
+    static const size_t MAX_FREE = 256;
+    static const size_t MAX_FREE_BYTES = 4 << 20;
+    pool_buffer* _free[CLASSES] = {};
+    size_t _free_count[CLASSES] = {};
+
+    // Large classes keep fewer free buffers.
+    static size_t max_free(int size_class) {
+        size_t count = MAX_FREE_BYTES / CLASS_SIZE[size_class];
+        return count < MAX_FREE ? count : MAX_FREE;
+    }
+};
+
+const size_t buffer_pool::CLASS_SIZE[] = {
+    512, 4096, 16384, 65536, 262144 };
+
+inline void intrusive_ptr_add_ref(pool_buffer* buf) {
+    ++buf->refs;
+}
+
+inline void intrusive_ptr_release(pool_buffer* buf) {
+    if (--buf->refs == 0) {
+        if (buf->pool)
+            buf->pool->recycle(buf);
+        else
+            free(buf);
+    }
+}
+
+// Buffer outside any pool, so it may be released on another thread.
+pool_buffer* heap_buffer(size_t size) {
+    auto buf = (pool_buffer*)malloc(sizeof(pool_buffer) + size);
+    if (!buf) throw std::bad_alloc();
+    buf->pool = NULL;
+    buf->refs = 0;
+    buf->size_class = -1;
+    buf->capacity = size;
+    return buf;
+}
+
 //--------------------------event----------------------------
 
 const char EVT_ACCEPT = 1;
 const char EVT_CONTINUE = 2;
+const char EVT_ACCEPT_BATCH = 3;
 
-const size_t MAX_EVT_MSG = 10240;
+const size_t EVT_RING_CAPACITY = 1024;
+const size_t EVT_INLINE_SIZE = 80;
 
+// POD slot, 128 bytes. `data` borrows memory owned by the event source
+// (e.g. a connection's read buffer), valid until the next operation on that
+// source. When it is NULL, the payload is stored in `inline_data`. `hold`
+// keeps the pooled buffer of `data` alive until the slot is released.
 struct event_message {
     char type;
     int dest_id;
+    int err;
     void* source;
-    string data;
+    const char* data;
+    size_t data_len;
+    pool_buffer* hold;
+    char inline_data[EVT_INLINE_SIZE];
+};
+
+// Fixed-capacity ring of event slots. Popped slots stay untouched until
+// release(), so payloads handed out by asio_get_batch remain valid until the
+// next batch. When full it doubles instead of dropping events, retiring the
+// old storage until release().
+class event_ring {
+private:
+    vector<event_message> _slots;
+    vector<vector<event_message> > _retired;
+    size_t _mask;
+    size_t _released = 0;
+    size_t _head = 0;
+    size_t _tail = 0;
+
+    void grow() {
+        vector<event_message> slots(_slots.size() * 2);
+        size_t mask = slots.size() - 1;
+        for (size_t i = _released; i != _tail; ++i)
+            slots[i & mask] = _slots[i & _mask];
+        _retired.push_back(std::move(_slots));
+        _slots.swap(slots);
+        _mask = mask;
+        ++overflows;
+    }
+
+public:
+    size_t high_watermark = 0;
+    size_t overflows = 0;
+
+    explicit event_ring(size_t capacity)
+        : _slots(capacity), _mask(capacity - 1)
+    {
+    }
+
+    ~event_ring() {
+        _head = _tail;
+        release();
+    }
+
+    bool empty() const { return _head == _tail; }
+    size_t size() const { return _tail - _head; }
+    size_t capacity() const { return _slots.size(); }
+
+    event_message& push() {
+        if (_tail - _released == _slots.size())
+            grow();
+        auto &evt = _slots[_tail++ & _mask];
+        if (size() > high_watermark)
+            high_watermark = size();
+        return evt;
+    }
+
+    event_message& pop() {
+        return _slots[_head++ & _mask];
+    }
+
+    void release() {
+        for (; _released != _head; ++_released) {
+            auto &evt = _slots[_released & _mask];
+            if (evt.hold) {
+                intrusive_ptr_release(evt.hold);
+                evt.hold = NULL;
+            }
+        }
+        _retired.clear();
+    }
 };
-typedef deque<event_message> event_message_queue;
-event_message_queue g_evt_queue;
 
-void push_event(char type, int id, void* source, const string &data) {
-    event_message evt;
+void push_event(event_ring& events, char type, int id, void* source,
+    int err = 0, const char* data = "", size_t data_len = 0,
+    pool_buffer* hold = NULL)
+{
+    auto &evt = events.push();
     evt.type = type;
     evt.dest_id = id;
+    evt.err = err;
     evt.source = source;
     evt.data = data;
-    g_evt_queue.push_back(std::move(evt));
+    evt.data_len = data_len;
+    evt.hold = hold;
+    if (hold)
+        intrusive_ptr_add_ref(hold);
+}
 
-    // just in case, would not be triggered
-    while (g_evt_queue.size() > MAX_EVT_MSG)
-        g_evt_queue.pop_front();
+// Same as push_event, but copies a small payload into the slot.
+void push_event_inline(event_ring& events, char type, int id, void* source,
+    int err, const void* payload, size_t size)
+{
+    auto &evt = events.push();
+    evt.type = type;
+    evt.dest_id = id;
+    evt.err = err;
+    evt.source = source;
+    evt.data = NULL;
+    evt.hold = NULL;
+    evt.data_len = std::min(size, EVT_INLINE_SIZE);
+    memcpy(evt.inline_data, payload, evt.data_len);
 }
 
-//----------------------write buffer-------------------------
+extern "C"
+struct event_message_for_ffi {
+    char type;
+    int dest_id;
+    int err;
+    void* source;
+    const char* data;
+    size_t data_len;
+};
 
-class shared_const_buffer
+// Result of an operation that completed without waiting. The caller reads
+// it from `out` instead of yielding for an event.
+bool complete_now(event_message_for_ffi* out, void* source,
+    const char* data, size_t data_len)
 {
+    out->type = EVT_CONTINUE;
+    out->err = 0;
+    out->source = source;
+    out->data = data;
+    out->data_len = data_len;
+    return true;
+}
+
+// Same for an operation that failed without waiting.
+bool fail_now(event_message_for_ffi* out, int err) {
+    out->type = EVT_CONTINUE;
+    out->err = err;
+    out->source = NULL;
+    out->data = "";
+    out->data_len = 0;
+    return true;
+}
+
+//--------------------------error----------------------------
+
+// Error codes handed to Lua. System errors keep their native value, errors
+// of the other categories carry the category id in the high 16 bits.
+enum error_category_id {
+    ERR_SYSTEM = 0,
+    ERR_MISC = 1,
+    ERR_NETDB = 2,
+    ERR_ADDRINFO = 3,
+    ERR_GENERIC = 4,
+};
+
+const int ERR_CAT_SHIFT = 16;
+
+int error_code_of(const std::error_code& ec) {
+    if (!ec) return 0;
+    int cat;
+    if (ec.category() == asio::system_category())
+        return ec.value();
+    else if (ec.category() == asio::error::get_misc_category())
+        cat = ERR_MISC;
+    else if (ec.category() == asio::error::get_netdb_category())
+        cat = ERR_NETDB;
+    else if (ec.category() == asio::error::get_addrinfo_category())
+        cat = ERR_ADDRINFO;
+    else
+        cat = ERR_GENERIC;
+    return (cat << ERR_CAT_SHIFT) | (ec.value() & 0xFFFF);
+}
+
+std::error_code error_code_from(int code) {
+    int value = (int16_t)(code & 0xFFFF);
+    switch (code >> ERR_CAT_SHIFT) {
+    case ERR_MISC:
+        return std::error_code(value, asio::error::get_misc_category());
+    case ERR_NETDB:
+        return std::error_code(value, asio::error::get_netdb_category());
+    case ERR_ADDRINFO:
+        return std::error_code(value, asio::error::get_addrinfo_category());
+    case ERR_GENERIC:
+        return std::error_code(value, std::generic_category());
+    default:
+        return std::error_code(code, asio::system_category());
+    }
+}
+
+//---------------------handler memory-------------------------
+
+// Counters of handler storage requests, for asio.stats().
+struct handler_stats {
+    uint64_t allocs;
+    uint64_t heap_allocs;
+};
+
+// Storage for the completion handlers of one object's pending operations:
+// SLOTS blocks reused as operations complete, the heap beyond that.
+class handler_memory {
+public:
+    explicit handler_memory(handler_stats& stats) : _stats(stats) {}
+    handler_memory(const handler_memory&) = delete;
+    handler_memory& operator=(const handler_memory&) = delete;
+
+    void* allocate(size_t size) {
+        ++_stats.allocs;
+        if (size <= SLOT_SIZE) {
+            for (int i = 0; i < SLOTS; ++i) {
+                if (!_used[i]) {
+                    _used[i] = true;
+                    return &_slots[i];
+                }
+            }
+        }
+        ++_stats.heap_allocs;
+        return ::operator new(size);
+    }
+
+    void deallocate(void* p) {
+        for (int i = 0; i < SLOTS; ++i) {
+            if (p == &_slots[i]) {
+                _used[i] = false;
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+private:
+    static const int SLOTS = 3;
+    static const size_t SLOT_SIZE = 384;
+    handler_stats& _stats;
+    std::aligned_storage<SLOT_SIZE>::type _slots[SLOTS];
+    bool _used[SLOTS] = {};
+};
+
+// Allocator associated with handlers through asio::bind_allocator.
+template <typename T>
+class handler_allocator {
 public:
-    // Construct from a std::string.
-    explicit shared_const_buffer(const std::string& data)
-        : _data(new std::vector<char>(data.begin(), data.end())),
-          _buffer(asio::buffer(*_data))
+    typedef T value_type;
+
+    explicit handler_allocator(handler_memory& memory) : _memory(memory) {}
+
+    template <typename U>
+    handler_allocator(const handler_allocator<U>& other)
+        : _memory(other._memory)
     {
     }
 
-    // Implement the ConstBufferSequence requirements.
-    typedef asio::const_buffer value_type;
-    typedef const asio::const_buffer* const_iterator;
-    const asio::const_buffer* begin() const { return &_buffer; }
-    const asio::const_buffer* end() const { return &_buffer + 1; }
+    bool operator==(const handler_allocator& other) const {
+        return &_memory == &other._memory;
+    }
+
+    bool operator!=(const handler_allocator& other) const {
+        return &_memory != &other._memory;
+    }
+
+    T* allocate(size_t n) const {
+        return static_cast<T*>(_memory.allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* p, size_t) const {
+        _memory.deallocate(p);
+    }
 
 private:
-    boost::shared_ptr<std::vector<char> > _data;
-    asio::const_buffer _buffer;
+    template <typename> friend class handler_allocator;
+    handler_memory& _memory;
 };
 
-//--------------------------client--------------------------
+// Binds `handler` to the handler memory `memory`.
+template <typename Handler>
+asio::allocator_binder<Handler, handler_allocator<char> >
+bind_memory(handler_memory& memory, Handler handler) {
+    return asio::bind_allocator(handler_allocator<char>(memory), handler);
+}
+
+//--------------------------timer----------------------------
+
+// Hierarchical timing wheel: LEVELS levels of SLOTS buckets, TICK_US per
+// tick, covering ~79 days. Every sleep and deadline lives here, driven by a
+// single steady_timer armed for the earliest pending expiry or cascade.
+// Nodes are pooled and buckets are intrusive lists, so add and cancel are
+// O(1) and allocation free in steady state.
+class timer_wheel {
+public:
+    typedef void (*callback)(void* arg, int dest_id);
+    typedef uint64_t timer_id;
 
-class connection : public boost::enable_shared_from_this<connection> {
 private:
-    tcp::socket _socket;
-    string _read_buff;
-    const size_t MAX_BUFF_SIZE = 10240;
+    typedef std::chrono::steady_clock clock;
+
+    static const int LEVELS = 6;
+    static const int SLOT_BITS = 6;
+    static const uint32_t SLOTS = 1 << SLOT_BITS;
+    static const uint32_t NIL = 0xFFFFFFFF;
+    static const uint64_t NEVER = ~(uint64_t)0;
+    static const int64_t TICK_US = 100;
+
+    struct node {
+        uint64_t expire;
+        callback fn;
+        void* arg;
+        int dest_id;
+        uint32_t gen;
+        uint32_t bucket;
+        uint32_t prev;
+        uint32_t next;
+    };
+
+    std::unique_ptr<asio::steady_timer> _timer;
+    handler_memory _handler_memory;
+    clock::time_point _origin;
+    uint64_t _now = 0;
+    uint64_t _armed = NEVER;
+    size_t _count = 0;
+    vector<node> _nodes;
+    uint32_t _free = NIL;
+    uint32_t _buckets[LEVELS * SLOTS];
+    uint64_t _occupied[LEVELS];
+
+    int64_t elapsed_us() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            clock::now() - _origin).count();
+    }
+
+    void link(uint32_t i) {
+        auto &n = _nodes[i];
+        uint32_t level = 0, slot;
+        if (n.expire <= _now) {
+            slot = _now & (SLOTS - 1);
+        } else {
+            uint64_t delta = n.expire - _now;
+            while (level < LEVELS - 1 &&
+                   delta >> (SLOT_BITS * (level + 1)))
+                ++level;
+            uint64_t expire = n.expire;
+            if (delta >> (SLOT_BITS * LEVELS))
+                expire = _now + (1ull << (SLOT_BITS * LEVELS)) - 1;
+            slot = (expire >> (SLOT_BITS * level)) & (SLOTS - 1);
+        }
+        n.bucket = level * SLOTS + slot;
+        n.prev = NIL;
+        n.next = _buckets[n.bucket];
+        if (n.next != NIL)
+            _nodes[n.next].prev = i;
+        _buckets[n.bucket] = i;
+        _occupied[level] |= 1ull << slot;
+    }
+
+    void unlink(uint32_t i) {
+        auto &n = _nodes[i];
+        if (n.prev != NIL)
+            _nodes[n.prev].next = n.next;
+        else
+            _buckets[n.bucket] = n.next;
+        if (n.next != NIL)
+            _nodes[n.next].prev = n.prev;
+        if (_buckets[n.bucket] == NIL)
+            _occupied[n.bucket / SLOTS] &= ~(1ull << (n.bucket % SLOTS));
+    }
+
+    void release(uint32_t i) {
+        auto &n = _nodes[i];
+        ++n.gen;
+        n.fn = NULL;
+        n.next = _free;
+        _free = i;
+        --_count;
+    }
+
+    // First tick after _now at which some bucket expires or cascades.
+    uint64_t next_tick() const {
+        uint64_t best = NEVER;
+        for (int level = 0; level < LEVELS; ++level) {
+            uint64_t bits = _occupied[level];
+            if (!bits) continue;
+            int shift = SLOT_BITS * level;
+            uint32_t cur = (_now >> shift) & (SLOTS - 1);
+            uint32_t from = (cur + 1) & (SLOTS - 1);
+            uint64_t rot = from ? (bits >> from) | (bits << (SLOTS - from))
+                                : bits;
+            uint64_t ahead = 1;
+            while (!(rot & 1)) {
+                rot >>= 1;
+                ++ahead;
+            }
+            uint64_t tick = ((_now >> shift) + ahead) << shift;
+            if (tick < best) best = tick;
+        }
+        return best;
+    }
+
+    void cascade() {
+        for (int level = 1; level < LEVELS; ++level) {
+            int shift = SLOT_BITS * level;
+            if (_now & ((1ull << shift) - 1)) break;
+            uint32_t bucket = level * SLOTS + ((_now >> shift) & (SLOTS - 1));
+            uint32_t i = _buckets[bucket];
+            _buckets[bucket] = NIL;
+            _occupied[level] &= ~(1ull << (bucket % SLOTS));
+            while (i != NIL) {
+                uint32_t next = _nodes[i].next;
+                link(i);
+                i = next;
+            }
+        }
+    }
+
+    void advance(uint64_t target) {
+        while (_count) {
+            uint64_t tick = next_tick();
+            if (tick > target) break;
+            _now = tick;
+            cascade();
+
+            uint32_t bucket = _now & (SLOTS - 1);
+            uint32_t i = _buckets[bucket];
+            _buckets[bucket] = NIL;
+            _occupied[0] &= ~(1ull << bucket);
+            while (i != NIL) {
+                auto &n = _nodes[i];
+                uint32_t next = n.next;
+                callback fn = n.fn;
+                void* arg = n.arg;
+                int dest_id = n.dest_id;
+                release(i);
+                fn(arg, dest_id);
+                i = next;
+            }
+        }
+        if (target > _now) _now = target;
+    }
 
-    void do_connect(const tcp::endpoint& endpoint, int dest_id) {
-        _socket.async_connect(endpoint, [this, dest_id](std::error_code ec)
+    void arm() {
+        if (!_timer) return;
+        if (!_count) {
+            if (_armed != NEVER) {
+                _armed = NEVER;
+                _timer->cancel();
+            }
+            return;
+        }
+        uint64_t tick = next_tick();
+        if (tick == _armed) return;
+        _armed = tick;
+        _timer->expires_at(_origin +
+            std::chrono::microseconds((int64_t)tick * TICK_US));
+        _timer->async_wait(bind_memory(_handler_memory,
+            [this](const std::error_code& ec)
         {
-            if (!ec) {
-                push_event(EVT_CONTINUE, dest_id, this, "");
+            if (ec == asio::error::operation_aborted) return;
+            _armed = NEVER;
+            advance(elapsed_us() / TICK_US);
+            arm();
+        }));
+    }
+
+public:
+    explicit timer_wheel(handler_stats& stats)
+        : _handler_memory(stats), _origin(clock::now())
+    {
+        for (auto &b : _buckets) b = NIL;
+        for (auto &o : _occupied) o = 0;
+    }
+
+    // Timers fire from `io` between start() and stop(). Pending timers
+    // stay cancellable after stop(), while the io_context goes away.
+    void start(asio::io_context& io) {
+        _timer.reset(new asio::steady_timer(io));
+        _armed = NEVER;
+        arm();
+    }
+
+    void stop() {
+        _timer.reset();
+    }
+
+    // Calls fn(arg, dest_id) once `sec` seconds have elapsed.
+    timer_id add(double sec, callback fn, void* arg, int dest_id) {
+        if (!_count)
+            _now = elapsed_us() / TICK_US;
+        int64_t us = (int64_t)(sec * 1000000);
+        uint64_t expire = (elapsed_us() + (us > 0 ? us : 0) + TICK_US - 1)
+            / TICK_US;
+        if (expire <= _now) expire = _now + 1;
+
+        uint32_t i = _free;
+        if (i == NIL) {
+            i = (uint32_t)_nodes.size();
+            _nodes.push_back(node());
+            _nodes[i].gen = 1;
+        } else {
+            _free = _nodes[i].next;
+        }
+        auto &n = _nodes[i];
+        n.expire = expire;
+        n.fn = fn;
+        n.arg = arg;
+        n.dest_id = dest_id;
+        link(i);
+        ++_count;
+        if (expire < _armed) arm();
+        return ((uint64_t)n.gen << 32) | i;
+    }
+
+    // Returns false when the timer already fired or was cancelled.
+    bool cancel(timer_id id) {
+        uint32_t i = (uint32_t)id;
+        if (i >= _nodes.size() || _nodes[i].gen != (uint32_t)(id >> 32)
+            || !_nodes[i].fn)
+            return false;
+        unlink(i);
+        release(i);
+        if (!_count) arm();
+        return true;
+    }
+};
+
+// Deadline of one pending operation. When it expires the operation is
+// cancelled through `signal` and finish() turns the abort into timed_out.
+struct op_deadline {
+    timer_wheel& timers;
+    asio::cancellation_signal signal;
+    timer_wheel::timer_id timer = 0;
+    bool expired = false;
+
+    explicit op_deadline(timer_wheel& timers) : timers(timers) {}
+
+    ~op_deadline() {
+        if (timer) timers.cancel(timer);
+    }
+
+    // Cancels a timer still armed by an operation whose finish() has not
+    // run, so it cannot expire the new one.
+    void start(double sec) {
+        if (timer) {
+            timers.cancel(timer);
+            timer = 0;
+        }
+        expired = false;
+        if (sec > 0)
+            timer = timers.add(sec, expire, this, 0);
+    }
+
+    // Turns the abort caused by the expired deadline into timed_out.
+    std::error_code check(std::error_code ec) const {
+        if (expired && ec == asio::error::operation_aborted)
+            return asio::error::timed_out;
+        return ec;
+    }
+
+    std::error_code finish(std::error_code ec) {
+        ec = check(ec);
+        if (timer) {
+            timers.cancel(timer);
+            timer = 0;
+        }
+        expired = false;
+        return ec;
+    }
+
+    static void expire(void* arg, int) {
+        auto deadline = (op_deadline*)arg;
+        deadline->timer = 0;
+        deadline->expired = true;
+        deadline->signal.emit(asio::cancellation_type::terminal);
+    }
+};
+
+//----------------------read buffer--------------------------
+
+// Connection input, in a buffer borrowed from `pool`. Received
+// bytes not yet handed to Lua live in [_head, _tail). Consumed bytes stay
+// untouched until the next prepare(), so events can borrow them until the
+// next operation on the connection; events hold a reference to slab().
+class input_buffer
+{
+public:
+    explicit input_buffer(buffer_pool& pool) : _pool(pool) {}
+
+    const char* data() const { return base() + _head; }
+    char* data() { return base() + _head; }
+    size_t size() const { return _tail - _head; }
+    pool_buffer* slab() const { return _buf.get(); }
+
+    // Room for at least `n` more bytes after the buffered ones.
+    char* prepare(size_t n) {
+        if (_head == _tail)
+            _head = _tail = 0;
+        size_t capacity = _buf ? _buf->capacity : 0;
+        if (capacity - _tail < n) {
+            size_t have = size();
+            if (capacity - have < n) {
+                boost::intrusive_ptr<pool_buffer> buf(
+                    _pool.acquire(have + n));
+                memcpy(buf->data(), data(), have);
+                _buf.swap(buf);
             } else {
-                push_event(EVT_CONTINUE, dest_id, NULL, ec.message());
+                memmove(_buf->data(), data(), have);
             }
-        });
+            _head = 0;
+            _tail = have;
+        }
+        return _buf->data() + _tail;
     }
 
-public:
-    typedef boost::shared_ptr<connection> pointer;
+    // Returns the committed bytes.
+    char* commit(size_t n) {
+        char* data = base() + _tail;
+        _tail += n;
+        return data;
+    }
+    void consume(size_t n) { _head += n; }
+
+    // Returns the buffer to the pool once everything was consumed, so
+    // connections without a read in flight hold none.
+    void release() {
+        if (_head == _tail) {
+            _buf.reset();
+            _head = _tail = 0;
+        }
+    }
+
+private:
+    buffer_pool& _pool;
+    boost::intrusive_ptr<pool_buffer> _buf;
+    size_t _head = 0;
+    size_t _tail = 0;
+
+    char* base() const {
+        static char empty[1];
+        return _buf ? _buf->data() : empty;
+    }
+};
+
+// Counters of socket reads, for the average size of a read.
+struct read_stats {
+    uint64_t reads;
+    uint64_t bytes;
+};
+
+// Counters of accepted connections and of the accept completions or
+// readable events that took them, for the average accepts per wakeup.
+struct accept_stats {
+    uint64_t accepts;
+    uint64_t wakeups;
+};
+
+//----------------------write buffer-------------------------
+
+// Queued send data: either a pooled copy or, when `buf` is null, bytes
+// borrowed from the caller until they are written.
+struct send_chunk {
+    boost::intrusive_ptr<pool_buffer> buf;
+    const char* data;
+    size_t size;
+};
 
-    connection(asio::io_context& io_context,
-        const tcp::endpoint& endpoint, int dest_id)
-        : _socket(io_context)
+// ConstBufferSequence viewing buffers owned by someone else, cheap to copy
+// into the write operation.
+class const_buffers_view
+{
+public:
+    explicit const_buffers_view(const std::vector<asio::const_buffer>& buffers)
+        : _begin(buffers.data()), _end(buffers.data() + buffers.size())
     {
-        do_connect(endpoint, dest_id);
     }
 
-    connection(tcp::socket socket)
-        : _socket(std::move(socket))
-    {
+    typedef asio::const_buffer value_type;
+    typedef const asio::const_buffer* const_iterator;
+    const asio::const_buffer* begin() const { return _begin; }
+    const asio::const_buffer* end() const { return _end; }
+
+private:
+    const asio::const_buffer* _begin;
+    const asio::const_buffer* _end;
+};
+
+//------------------------transform--------------------------
+
+// Stage rewriting a byte stream in place: received bytes before they are
+// buffered, sent bytes before they are queued. Each instance keeps the
+// stream position of one direction of one connection.
+class stream_transform {
+public:
+    virtual ~stream_transform() {}
+    virtual void apply(char* data, size_t size) = 0;
+};
+
+typedef boost::shared_ptr<stream_transform> transform_ptr;
+
+// XOR kernels. `pattern` is the key repeated to period + 32 bytes, period
+// being a multiple of the key length of at least 32, so the keystream at
+// `pos` is a plain load and pos stays below period with one subtraction.
+typedef void (*xor_kernel)(char* data, size_t size, const char* pattern,
+    size_t period, size_t& pos);
+
+static void xor_scalar(char* data, size_t size, const char* pattern,
+    size_t period, size_t& pos)
+{
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word, key;
+        memcpy(&word, data, 8);
+        memcpy(&key, pattern + pos, 8);
+        word ^= key;
+        memcpy(data, &word, 8);
+        pos += 8;
+        if (pos >= period) pos -= period;
+    }
+    for (; size; ++data, --size) {
+        *data ^= pattern[pos];
+        if (++pos == period) pos = 0;
+    }
+}
+
+#ifdef LUAASIO_X86
+TARGET_SSE2
+static void xor_sse2(char* data, size_t size, const char* pattern,
+    size_t period, size_t& pos)
+{
+    for (; size >= 16; data += 16, size -= 16) {
+        __m128i word = _mm_loadu_si128((const __m128i*)data);
+        __m128i key = _mm_loadu_si128((const __m128i*)(pattern + pos));
+        _mm_storeu_si128((__m128i*)data, _mm_xor_si128(word, key));
+        pos += 16;
+        if (pos >= period) pos -= period;
+    }
+    xor_scalar(data, size, pattern, period, pos);
+}
+
+TARGET_AVX2
+static void xor_avx2(char* data, size_t size, const char* pattern,
+    size_t period, size_t& pos)
+{
+    for (; size >= 32; data += 32, size -= 32) {
+        __m256i word = _mm256_loadu_si256((const __m256i*)data);
+        __m256i key = _mm256_loadu_si256((const __m256i*)(pattern + pos));
+        _mm256_storeu_si256((__m256i*)data, _mm256_xor_si256(word, key));
+        pos += 32;
+        if (pos >= period) pos -= period;
+    }
+    xor_scalar(data, size, pattern, period, pos);
+}
+
+static bool cpu_has_avx2() {
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 1);
+    bool avx = (regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) &&
+        (_xgetbv(0) & 6) == 6;
+    __cpuidex(regs, 7, 0);
+    return avx && (regs[1] & (1 << 5));
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+static xor_kernel select_xor_kernel() {
+#ifdef LUAASIO_X86
+    if (cpu_has_avx2())
+        return xor_avx2;
+    return xor_sse2;
+#else
+    return xor_scalar;
+#endif
+}
+
+static const xor_kernel g_xor_kernel = select_xor_kernel();
+
+// XOR with a repeating key, continuing where the previous call stopped.
+class xor_transform : public stream_transform {
+public:
+    xor_transform(const char* key, size_t key_len) {
+        _period = key_len * ((32 + key_len - 1) / key_len);
+        _pattern.resize(_period + 32);
+        for (size_t i = 0; i < _pattern.size(); ++i)
+            _pattern[i] = key[i % key_len];
+    }
+
+    void apply(char* data, size_t size) override {
+        g_xor_kernel(data, size, _pattern.data(), _period, _pos);
+    }
+
+private:
+    vector<char> _pattern;
+    size_t _period;
+    size_t _pos = 0;
+};
+
+// AES-256 block encryption, the only direction CFB and CTR need. Uses
+// AES-NI when the CPU has it, T-tables otherwise.
+static const uint8_t AES_SBOX[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b,
+    0xfe, 0xd7, 0xab, 0x76, 0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+    0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0, 0xb7, 0xfd, 0x93, 0x26,
+    0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2,
+    0xeb, 0x27, 0xb2, 0x75, 0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+    0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84, 0x53, 0xd1, 0x00, 0xed,
+    0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f,
+    0x50, 0x3c, 0x9f, 0xa8, 0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+    0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2, 0xcd, 0x0c, 0x13, 0xec,
+    0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14,
+    0xde, 0x5e, 0x0b, 0xdb, 0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+    0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79, 0xe7, 0xc8, 0x37, 0x6d,
+    0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f,
+    0x4b, 0xbd, 0x8b, 0x8a, 0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+    0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e, 0xe1, 0xf8, 0x98, 0x11,
+    0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f,
+    0xb0, 0x54, 0xbb, 0x16,
+};
+
+static inline uint32_t load_be32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+        (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void store_be32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+// Round table: Te[0][x] is the MixColumns column of SubBytes(x), the other
+// three are its byte rotations.
+struct aes_tables {
+    uint32_t te[4][256];
+
+    aes_tables() {
+        for (int x = 0; x < 256; ++x) {
+            uint32_t s = AES_SBOX[x];
+            uint32_t s2 = (s << 1) ^ (s & 0x80 ? 0x11b : 0);
+            uint32_t w = s2 << 24 | s << 16 | s << 8 | (s2 ^ s);
+            for (int i = 0; i < 4; ++i) {
+                te[i][x] = w;
+                w = w >> 8 | w << 24;
+            }
+        }
+    }
+};
+
+static const aes_tables g_aes_tables;
+
+static void aes256_encrypt_soft(const uint32_t* w, const uint8_t* in,
+    uint8_t* out)
+{
+    auto &te = g_aes_tables.te;
+    uint32_t s0 = load_be32(in) ^ w[0];
+    uint32_t s1 = load_be32(in + 4) ^ w[1];
+    uint32_t s2 = load_be32(in + 8) ^ w[2];
+    uint32_t s3 = load_be32(in + 12) ^ w[3];
+    for (int round = 1; round < 14; ++round) {
+        const uint32_t* k = w + round * 4;
+        uint32_t t0 = te[0][s0 >> 24] ^ te[1][(s1 >> 16) & 0xff] ^
+            te[2][(s2 >> 8) & 0xff] ^ te[3][s3 & 0xff] ^ k[0];
+        uint32_t t1 = te[0][s1 >> 24] ^ te[1][(s2 >> 16) & 0xff] ^
+            te[2][(s3 >> 8) & 0xff] ^ te[3][s0 & 0xff] ^ k[1];
+        uint32_t t2 = te[0][s2 >> 24] ^ te[1][(s3 >> 16) & 0xff] ^
+            te[2][(s0 >> 8) & 0xff] ^ te[3][s1 & 0xff] ^ k[2];
+        uint32_t t3 = te[0][s3 >> 24] ^ te[1][(s0 >> 16) & 0xff] ^
+            te[2][(s1 >> 8) & 0xff] ^ te[3][s2 & 0xff] ^ k[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+    const uint32_t* k = w + 56;
+    uint32_t s[4] = { s0, s1, s2, s3 };
+    for (int i = 0; i < 4; ++i) {
+        uint32_t v = (uint32_t)AES_SBOX[s[i] >> 24] << 24 |
+            (uint32_t)AES_SBOX[(s[(i + 1) & 3] >> 16) & 0xff] << 16 |
+            (uint32_t)AES_SBOX[(s[(i + 2) & 3] >> 8) & 0xff] << 8 |
+            AES_SBOX[s[(i + 3) & 3] & 0xff];
+        store_be32(out + i * 4, v ^ k[i]);
+    }
+}
+
+#ifdef LUAASIO_X86
+// Encrypts `blocks` blocks, four at a time to hide the aesenc latency.
+TARGET_AESNI
+static void aes256_encrypt_ni(const uint8_t* rk, const uint8_t* in,
+    uint8_t* out, size_t blocks)
+{
+    __m128i k[15];
+    for (int i = 0; i < 15; ++i)
+        k[i] = _mm_loadu_si128((const __m128i*)(rk + i * 16));
+    for (; blocks >= 4; blocks -= 4, in += 64, out += 64) {
+        __m128i b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), k[0]);
+        __m128i b1 = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i*)(in + 16)), k[0]);
+        __m128i b2 = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i*)(in + 32)), k[0]);
+        __m128i b3 = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i*)(in + 48)), k[0]);
+        for (int i = 1; i < 14; ++i) {
+            b0 = _mm_aesenc_si128(b0, k[i]);
+            b1 = _mm_aesenc_si128(b1, k[i]);
+            b2 = _mm_aesenc_si128(b2, k[i]);
+            b3 = _mm_aesenc_si128(b3, k[i]);
+        }
+        _mm_storeu_si128((__m128i*)out, _mm_aesenclast_si128(b0, k[14]));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_aesenclast_si128(b1, k[14]));
+        _mm_storeu_si128((__m128i*)(out + 32), _mm_aesenclast_si128(b2, k[14]));
+        _mm_storeu_si128((__m128i*)(out + 48), _mm_aesenclast_si128(b3, k[14]));
+    }
+    for (; blocks; --blocks, in += 16, out += 16) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), k[0]);
+        for (int i = 1; i < 14; ++i)
+            b = _mm_aesenc_si128(b, k[i]);
+        _mm_storeu_si128((__m128i*)out, _mm_aesenclast_si128(b, k[14]));
+    }
+}
+
+static bool cpu_has_aesni() {
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 1);
+    return (regs[2] & (1 << 25)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes");
+#endif
+}
+#else
+static bool cpu_has_aesni() { return false; }
+#endif
+
+static const bool g_has_aesni = cpu_has_aesni();
+
+class aes256 {
+public:
+    explicit aes256(const uint8_t* key) {
+        static const uint8_t RCON[7] = {
+            0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40 };
+        for (int i = 0; i < 8; ++i)
+            _w[i] = load_be32(key + i * 4);
+        for (int i = 8; i < 60; ++i) {
+            uint32_t t = _w[i - 1];
+            if (i % 8 == 0)
+                t = t << 8 | t >> 24;
+            if (i % 4 == 0)
+                t = (uint32_t)AES_SBOX[t >> 24] << 24 |
+                    (uint32_t)AES_SBOX[(t >> 16) & 0xff] << 16 |
+                    (uint32_t)AES_SBOX[(t >> 8) & 0xff] << 8 |
+                    AES_SBOX[t & 0xff];
+            if (i % 8 == 0)
+                t ^= (uint32_t)RCON[i / 8 - 1] << 24;
+            _w[i] = _w[i - 8] ^ t;
+        }
+        for (int i = 0; i < 60; ++i)
+            store_be32(_rk + i * 4, _w[i]);
+    }
+
+    void encrypt(const uint8_t* in, uint8_t* out, size_t blocks) const {
+#ifdef LUAASIO_X86
+        if (g_has_aesni)
+            return aes256_encrypt_ni(_rk, in, out, blocks);
+#endif
+        for (; blocks; --blocks, in += 16, out += 16)
+            aes256_encrypt_soft(_w, in, out);
+    }
+
+private:
+    uint32_t _w[60];
+    uint8_t _rk[240];
+};
+
+// AES-256-CTR with a 128-bit big-endian counter starting at the IV.
+class aes_ctr_transform : public stream_transform {
+public:
+    aes_ctr_transform(const char* key, const char* iv)
+        : _aes((const uint8_t*)key)
+    {
+        memcpy(_counter, iv, 16);
+    }
+
+    void apply(char* data, size_t size) override {
+        for (; size && _pos < 16; ++data, --size)
+            *data ^= _ks[_pos++];
+        while (size >= 16) {
+            size_t blocks = size / 16;
+            if (blocks > BATCH)
+                blocks = BATCH;
+            for (size_t i = 0; i < blocks; ++i)
+                next_counter(_batch_in + i * 16);
+            _aes.encrypt(_batch_in, _batch_out, blocks);
+            size_t pos = 0;
+            g_xor_kernel(data, blocks * 16, (const char*)_batch_out,
+                blocks * 16, pos);
+            data += blocks * 16;
+            size -= blocks * 16;
+        }
+        if (size) {
+            next_counter(_batch_in);
+            _aes.encrypt(_batch_in, _ks, 1);
+            for (_pos = 0; _pos < size; ++_pos)
+                data[_pos] ^= _ks[_pos];
+        }
+    }
+
+private:
+    static const size_t BATCH = 32;
+    aes256 _aes;
+    uint8_t _counter[16];
+    uint8_t _ks[16];
+    size_t _pos = 16;
+    uint8_t _batch_in[BATCH * 16];
+    uint8_t _batch_out[BATCH * 16];
+
+    void next_counter(uint8_t* block) {
+        memcpy(block, _counter, 16);
+        for (int i = 15; i >= 0 && ++_counter[i] == 0; --i) {}
+    }
+};
+
+// AES-256-CFB128. The register holds the last ciphertext block until it
+// is encrypted in place into the next keystream block, and then takes the
+// new ciphertext byte by byte.
+class aes_cfb_transform : public stream_transform {
+public:
+    aes_cfb_transform(const char* key, const char* iv, bool encrypt)
+        : _aes((const uint8_t*)key), _encrypt(encrypt)
+    {
+        memcpy(_reg, iv, 16);
+    }
+
+    void apply(char* data, size_t size) override {
+        uint8_t* p = (uint8_t*)data;
+        while (size) {
+            if (_pos == 16) {
+                _aes.encrypt(_reg, _reg, 1);
+                _pos = 0;
+            }
+            size_t n = std::min(size, 16 - _pos);
+            for (size_t i = 0; i < n; ++i, ++_pos) {
+                uint8_t in = p[i];
+                p[i] = in ^ _reg[_pos];
+                _reg[_pos] = _encrypt ? p[i] : in;
+            }
+            p += n;
+            size -= n;
+        }
+    }
+
+private:
+    aes256 _aes;
+    bool _encrypt;
+    uint8_t _reg[16];
+    size_t _pos = 16;
+};
+
+// Returns NULL for an unknown kind or a key or IV it does not accept.
+// `encrypt` tells the write side from the read side.
+stream_transform* make_transform(const char* kind, const char* key,
+    size_t key_len, const char* iv, size_t iv_len, bool encrypt)
+{
+    if (!strcmp(kind, "xor"))
+        return key_len ? new xor_transform(key, key_len) : NULL;
+    if (key_len != 32 || iv_len != 16)
+        return NULL;
+    if (!strcmp(kind, "aes-256-ctr"))
+        return new aes_ctr_transform(key, iv);
+    if (!strcmp(kind, "aes-256-cfb"))
+        return new aes_cfb_transform(key, iv, encrypt);
+    return NULL;
+}
+
+//--------------------------aead-----------------------------
+
+static inline uint32_t load_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+        (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store_le32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+template <typename T>
+static inline T rotl32(T v, int n) {
+    return (v << n) | (v >> (32 - n));
+}
+
+template <typename T>
+static inline void chacha_quarter(T& a, T& b, T& c, T& d) {
+    a += b; d ^= a; d = rotl32(d, 16);
+    c += d; b ^= c; b = rotl32(b, 12);
+    a += b; d ^= a; d = rotl32(d, 8);
+    c += d; b ^= c; b = rotl32(b, 7);
+}
+
+template <typename T>
+static inline void chacha_rounds(T* x) {
+    for (int i = 0; i < 10; ++i) {
+        chacha_quarter(x[0], x[4], x[8], x[12]);
+        chacha_quarter(x[1], x[5], x[9], x[13]);
+        chacha_quarter(x[2], x[6], x[10], x[14]);
+        chacha_quarter(x[3], x[7], x[11], x[15]);
+        chacha_quarter(x[0], x[5], x[10], x[15]);
+        chacha_quarter(x[1], x[6], x[11], x[12]);
+        chacha_quarter(x[2], x[7], x[8], x[13]);
+        chacha_quarter(x[3], x[4], x[9], x[14]);
+    }
+}
+
+static void chacha20_block(const uint32_t* state, uint8_t* out) {
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+    chacha_rounds(x);
+    for (int i = 0; i < 16; ++i)
+        store_le32(out + i * 4, x[i] + state[i]);
+}
+
+#ifdef __GNUC__
+// Four consecutive blocks, one per vector lane. GCC lowers the vector type
+// to SSE2 or NEON, and to plain registers on targets without SIMD.
+#define LUAASIO_CHACHA_X4
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+static void chacha20_block_x4(const uint32_t* state, uint8_t* out) {
+    u32x4 x[16], in[16];
+    for (int i = 0; i < 16; ++i)
+        in[i] = (u32x4){ state[i], state[i], state[i], state[i] };
+    in[12] += (u32x4){ 0, 1, 2, 3 };
+    memcpy(x, in, sizeof(x));
+    chacha_rounds(x);
+    for (int i = 0; i < 16; ++i) {
+        x[i] += in[i];
+        for (int lane = 0; lane < 4; ++lane)
+            store_le32(out + lane * 64 + i * 4, x[i][lane]);
+    }
+}
+#endif
+
+// XORs the ChaCha20 keystream from block `state[12]` on into `data`.
+static void chacha20_xor(uint32_t* state, uint8_t* data, size_t size) {
+    uint8_t ks[256];
+#ifdef LUAASIO_CHACHA_X4
+    for (; size >= 256; data += 256, size -= 256) {
+        chacha20_block_x4(state, ks);
+        state[12] += 4;
+        size_t pos = 0;
+        g_xor_kernel((char*)data, 256, (const char*)ks, 256, pos);
+    }
+#endif
+    while (size) {
+        chacha20_block(state, ks);
+        ++state[12];
+        size_t n = std::min(size, (size_t)64);
+        for (size_t i = 0; i < n; ++i)
+            data[i] ^= ks[i];
+        data += n;
+        size -= n;
+    }
+}
+
+// Poly1305 with 26-bit limbs, after poly1305-donna.
+class poly1305 {
+public:
+    explicit poly1305(const uint8_t* key) {
+        _r[0] = load_le32(key) & 0x3ffffff;
+        _r[1] = (load_le32(key + 3) >> 2) & 0x3ffff03;
+        _r[2] = (load_le32(key + 6) >> 4) & 0x3ffc0ff;
+        _r[3] = (load_le32(key + 9) >> 6) & 0x3f03fff;
+        _r[4] = (load_le32(key + 12) >> 8) & 0x00fffff;
+        for (int i = 0; i < 4; ++i)
+            _pad[i] = load_le32(key + 16 + i * 4);
+    }
+
+    // The last partial block is zero padded, as the AEAD construction
+    // pads its inputs.
+    void update(const uint8_t* m, size_t size) {
+        for (; size >= 16; m += 16, size -= 16)
+            block(m);
+        if (size) {
+            uint8_t last[16] = {};
+            memcpy(last, m, size);
+            block(last);
+        }
+    }
+
+    void finish(uint8_t* mac) {
+        uint32_t h0 = _h[0], h1 = _h[1], h2 = _h[2], h3 = _h[3], h4 = _h[4];
+        uint32_t c;
+        c = h1 >> 26; h1 &= 0x3ffffff; h2 += c;
+        c = h2 >> 26; h2 &= 0x3ffffff; h3 += c;
+        c = h3 >> 26; h3 &= 0x3ffffff; h4 += c;
+        c = h4 >> 26; h4 &= 0x3ffffff; h0 += c * 5;
+        c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+
+        // h - p, picked when it does not borrow.
+        uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+        uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+        uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+        uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+        uint32_t g4 = h4 + c - (1 << 26);
+        uint32_t mask = (g4 >> 31) - 1;
+        h0 = (h0 & ~mask) | (g0 & mask);
+        h1 = (h1 & ~mask) | (g1 & mask);
+        h2 = (h2 & ~mask) | (g2 & mask);
+        h3 = (h3 & ~mask) | (g3 & mask);
+        h4 = (h4 & ~mask) | (g4 & mask);
+
+        uint32_t w[4] = {
+            h0 | h1 << 26,
+            h1 >> 6 | h2 << 20,
+            h2 >> 12 | h3 << 14,
+            h3 >> 18 | h4 << 8,
+        };
+        uint64_t f = 0;
+        for (int i = 0; i < 4; ++i) {
+            f = (uint64_t)w[i] + _pad[i] + (f >> 32);
+            store_le32(mac + i * 4, (uint32_t)f);
+        }
+    }
+
+private:
+    uint32_t _r[5];
+    uint32_t _h[5] = {};
+    uint32_t _pad[4];
+
+    void block(const uint8_t* m) {
+        const uint32_t r0 = _r[0], r1 = _r[1], r2 = _r[2], r3 = _r[3],
+            r4 = _r[4];
+        const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+        uint32_t h0 = _h[0] + (load_le32(m) & 0x3ffffff);
+        uint32_t h1 = _h[1] + ((load_le32(m + 3) >> 2) & 0x3ffffff);
+        uint32_t h2 = _h[2] + ((load_le32(m + 6) >> 4) & 0x3ffffff);
+        uint32_t h3 = _h[3] + ((load_le32(m + 9) >> 6) & 0x3ffffff);
+        uint32_t h4 = _h[4] + ((load_le32(m + 12) >> 8) | (1 << 24));
+
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 +
+            (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 +
+            (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 +
+            (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 +
+            (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 +
+            (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        uint32_t c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+        _h[0] = h0; _h[1] = h1; _h[2] = h2; _h[3] = h3; _h[4] = h4;
+    }
+};
+
+// ChaCha20-Poly1305 (RFC 8439) without associated data. The 96-bit nonce
+// is a little-endian counter advanced by every seal or open, so each key
+// must only ever be used for one direction of one connection.
+class chacha20_poly1305 {
+public:
+    static const size_t TAG_SIZE = 16;
+
+    explicit chacha20_poly1305(const char* key) {
+        for (int i = 0; i < 8; ++i)
+            _key[i] = load_le32((const uint8_t*)key + i * 4);
+    }
+
+    // Encrypts in place and writes the tag.
+    void seal(uint8_t* data, size_t size, uint8_t* tag) {
+        uint32_t state[16];
+        uint8_t mac_key[64];
+        start(state, mac_key);
+        chacha20_xor(state, data, size);
+        mac(mac_key, data, size, tag);
+        next_nonce();
+    }
+
+    // Checks the tag and decrypts in place. Nothing is decrypted and the
+    // nonce does not advance when it fails.
+    bool open(uint8_t* data, size_t size, const uint8_t* tag) {
+        uint32_t state[16];
+        uint8_t mac_key[64], expect[TAG_SIZE];
+        start(state, mac_key);
+        mac(mac_key, data, size, expect);
+        uint8_t diff = 0;
+        for (size_t i = 0; i < TAG_SIZE; ++i)
+            diff |= expect[i] ^ tag[i];
+        if (diff)
+            return false;
+        chacha20_xor(state, data, size);
+        next_nonce();
+        return true;
+    }
+
+private:
+    uint32_t _key[8];
+    uint8_t _nonce[12] = {};
+
+    // Block 0 keys Poly1305, the data is ciphered from block 1 on.
+    void start(uint32_t* state, uint8_t* mac_key) {
+        state[0] = 0x61707865;
+        state[1] = 0x3320646e;
+        state[2] = 0x79622d32;
+        state[3] = 0x6b206574;
+        memcpy(state + 4, _key, sizeof(_key));
+        state[12] = 0;
+        for (int i = 0; i < 3; ++i)
+            state[13 + i] = load_le32(_nonce + i * 4);
+        chacha20_block(state, mac_key);
+        state[12] = 1;
+    }
+
+    static void mac(const uint8_t* mac_key, const uint8_t* data, size_t size,
+        uint8_t* tag)
+    {
+        poly1305 poly(mac_key);
+        poly.update(data, size);
+        uint8_t lengths[16] = {};
+        for (int i = 0; i < 8; ++i)
+            lengths[8 + i] = (uint8_t)((uint64_t)size >> (i * 8));
+        poly.update(lengths, 16);
+        poly.finish(tag);
+    }
+
+    void next_nonce() {
+        for (int i = 0; i < 12 && ++_nonce[i] == 0; ++i) {}
+    }
+};
+
+//---------------------socket options------------------------
+
+// TCP options settable by name. Values are integers, flags are 0 or 1, the
+// keepalive times are in seconds. An option the platform lacks fails with
+// EOPNOTSUPP.
+enum socket_option_id {
+    OPT_NODELAY,
+    OPT_SNDBUF,
+    OPT_RCVBUF,
+    OPT_KEEPALIVE,
+    OPT_KEEPIDLE,
+    OPT_KEEPINTVL,
+    OPT_KEEPCNT,
+    OPT_QUICKACK,
+    OPT_CORK,
+    OPT_NOTSENT_LOWAT,
+    OPT_COUNT,
+};
+
+const char* const SOCKET_OPTION_NAMES[OPT_COUNT] = {
+    "nodelay", "sndbuf", "rcvbuf", "keepalive", "keepalive_idle",
+    "keepalive_interval", "keepalive_count", "quickack", "cork",
+    "notsent_lowat" };
+
+// Returns the socket_option_id named `name`, -1 for an unknown name.
+int socket_option_of(const char* name) {
+    for (int i = 0; i < OPT_COUNT; ++i) {
+        if (!strcmp(name, SOCKET_OPTION_NAMES[i]))
+            return i;
+    }
+    return -1;
+}
+
+template <int Level, int Name>
+std::error_code set_int_option(tcp::socket& socket, int value) {
+    std::error_code ec;
+    socket.set_option(
+        asio::detail::socket_option::integer<Level, Name>(value), ec);
+    return ec;
+}
+
+std::error_code set_socket_option(tcp::socket& socket, int opt, int value) {
+    std::error_code ec;
+    switch (opt) {
+    case OPT_NODELAY:
+        socket.set_option(tcp::no_delay(value != 0), ec);
+        return ec;
+    case OPT_SNDBUF:
+        socket.set_option(asio::socket_base::send_buffer_size(value), ec);
+        return ec;
+    case OPT_RCVBUF:
+        socket.set_option(asio::socket_base::receive_buffer_size(value), ec);
+        return ec;
+    case OPT_KEEPALIVE:
+        socket.set_option(asio::socket_base::keep_alive(value != 0), ec);
+        return ec;
+#if defined(TCP_KEEPIDLE)
+    case OPT_KEEPIDLE:
+        return set_int_option<IPPROTO_TCP, TCP_KEEPIDLE>(socket, value);
+#elif defined(TCP_KEEPALIVE)
+    case OPT_KEEPIDLE:
+        return set_int_option<IPPROTO_TCP, TCP_KEEPALIVE>(socket, value);
+#endif
+#ifdef TCP_KEEPINTVL
+    case OPT_KEEPINTVL:
+        return set_int_option<IPPROTO_TCP, TCP_KEEPINTVL>(socket, value);
+#endif
+#ifdef TCP_KEEPCNT
+    case OPT_KEEPCNT:
+        return set_int_option<IPPROTO_TCP, TCP_KEEPCNT>(socket, value);
+#endif
+#ifdef TCP_QUICKACK
+    case OPT_QUICKACK:
+        return set_int_option<IPPROTO_TCP, TCP_QUICKACK>(socket, value != 0);
+#endif
+#if defined(TCP_CORK)
+    case OPT_CORK:
+        return set_int_option<IPPROTO_TCP, TCP_CORK>(socket, value != 0);
+#elif defined(TCP_NOPUSH)
+    case OPT_CORK:
+        return set_int_option<IPPROTO_TCP, TCP_NOPUSH>(socket, value != 0);
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+    case OPT_NOTSENT_LOWAT:
+        return set_int_option<IPPROTO_TCP, TCP_NOTSENT_LOWAT>(socket, value);
+#endif
+    default:
+        return asio::error::operation_not_supported;
+    }
+}
+
+//--------------------------loop-----------------------------
+
+class connection;
+void intrusive_ptr_add_ref(connection* conn);
+void intrusive_ptr_release(connection* conn);
+
+
+// Connections are handed to Lua as handles below 2^52, exact in a Lua
+// number: a 24-bit slot index and a 28-bit generation that changes whenever
+// the slot is freed, so a stale handle is detected instead of reaching a
+// reused connection. A slot whose generation would wrap is retired. 0 is
+// never a valid handle.
+typedef uint64_t conn_handle;
+
+class handle_table {
+public:
+    handle_table() {}
+    handle_table(const handle_table&) = delete;
+    handle_table& operator=(const handle_table&) = delete;
+
+    ~handle_table() {
+        for (auto &sl : _slots) {
+            if (sl.conn)
+                intrusive_ptr_release(sl.conn);
+        }
+    }
+
+    // Returns the handle of `conn`, 0 when every slot is taken.
+    conn_handle add(connection* conn) {
+        uint32_t index;
+        if (_free != NIL) {
+            index = _free;
+            _free = _slots[index].next_free;
+        } else {
+            if (_slots.size() > INDEX_MASK)
+                return 0;
+            index = (uint32_t)_slots.size();
+            _slots.push_back(slot());
+        }
+        slot& sl = _slots[index];
+        sl.conn = conn;
+        intrusive_ptr_add_ref(conn);
+        return (conn_handle)sl.generation << INDEX_BITS | index;
+    }
+
+    connection* get(conn_handle handle) const {
+        uint32_t index = handle & INDEX_MASK;
+        if (index >= _slots.size())
+            return NULL;
+        const slot& sl = _slots[index];
+        if (sl.generation != handle >> INDEX_BITS)
+            return NULL;
+        return sl.conn;
+    }
+
+    // Drops the table's reference and frees the slot.
+    void remove(conn_handle handle) {
+        if (!get(handle))
+            return;
+        uint32_t index = handle & INDEX_MASK;
+        slot& sl = _slots[index];
+        connection* conn = sl.conn;
+        sl.conn = NULL;
+        if (++sl.generation <= GENERATION_MAX) {
+            sl.next_free = _free;
+            _free = index;
+        }
+        intrusive_ptr_release(conn);
+    }
+
+private:
+    static const int INDEX_BITS = 24;
+    static const uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+    static const uint32_t GENERATION_MAX = (1u << 28) - 1;
+    static const uint32_t NIL = 0xFFFFFFFF;
+
+    struct slot {
+        connection* conn = NULL;
+        uint32_t generation = 1;
+        uint32_t next_free = NIL;
+    };
+
+    vector<slot> _slots;
+    uint32_t _free = NIL;
+};
+
+// Error of calls made with a stale or invalid handle.
+int bad_handle() {
+    return error_code_of(asio::error::bad_descriptor);
+}
+
+// Everything one event loop owns. Each Lua state creates its own loop and
+// passes it to every call, so loops are independent and several of them
+// can run in one process, one per thread.
+struct asio_loop {
+    buffer_pool buffers;
+    read_stats reads = {};
+    accept_stats accepts = {};
+    handler_stats handlers = {};
+    event_ring events;
+    timer_wheel timers;
+    asio::io_context io;
+    handle_table handles;
+    bool stopping = false;
+
+    // Results returned to Lua as pointers, valid until the next such call.
+    string text;
+    sockaddr_storage addr;
+
+    // Slabs of reads that completed at once, held like those of delivered
+    // events until the next batch.
+    vector<boost::intrusive_ptr<pool_buffer> > views;
+
+    asio_loop() : events(EVT_RING_CAPACITY), timers(handlers) {
+        timers.start(io);
+    }
+
+    // Timers outlive the io_context: handlers destroyed with it may still
+    // cancel their deadlines.
+    ~asio_loop() {
+        timers.stop();
+    }
+};
+
+//--------------------------client--------------------------
+
+class connection {
+    friend class forwarder;
+
+    friend void intrusive_ptr_add_ref(connection* conn) {
+        ++conn->_refs;
+    }
+
+    friend void intrusive_ptr_release(connection* conn) {
+        if (--conn->_refs == 0)
+            delete conn;
+    }
+
+private:
+    int _refs = 0;
+    asio_loop& _loop;
+    tcp::socket _socket;
+    input_buffer _in;
+    string _delim;
+    size_t _read_ahead = 0;
+    vector<asio::const_buffer> _gather;
+    vector<asio::const_buffer> _send_gather;
+    vector<transform_ptr> _read_transforms;
+    vector<transform_ptr> _write_transforms;
+
+    // AEAD framing: a sealed 2-byte big-endian payload length, then the
+    // sealed payload of at most FRAME_MAX bytes. _frame_size is the sealed
+    // size of the payload whose header was opened, 0 before a header.
+    boost::shared_ptr<chacha20_poly1305> _frame_sealer;
+    boost::shared_ptr<chacha20_poly1305> _frame_opener;
+    size_t _frame_size = 0;
+    const size_t FRAME_MAX = 0x3FFF;
+    const size_t FRAME_HEADER = 2 + chacha20_poly1305::TAG_SIZE;
+
+    // Send queue, used in pipelined mode and by writes issued while it
+    // still drains. [0, _sending) of it is being written.
+    deque<send_chunk> _send_queue;
+    size_t _sending = 0;
+    size_t _queued_bytes = 0;
+    size_t _send_hwm = 0;
+    bool _pipelined = false;
+    int _send_err = 0;
+    int _drain_waiter = -1;
+    size_t _drain_level = 0;
+
+    // A light thread waits for a write or a drain. Only one may: the next
+    // write fails with already_started until it resumed.
+    bool _write_parked = false;
+    const size_t MAX_GATHER = 64;
+    const size_t COALESCE_SIZE = 4096;
+
+    // Size of the reads that take whatever is available: doubled after a
+    // read filled it, halved after two reads in a row used less than half.
+    size_t _read_size = 16384;
+    size_t _read_min = 2048;
+    size_t _read_max = 262144;
+    int _read_short = 0;
+    bool _read_wait = false;
+    op_deadline _read_deadline;
+    op_deadline _write_deadline;
+    handler_memory _handler_memory;
+
+    template <typename Handler>
+    asio::allocator_binder<Handler, handler_allocator<char> >
+    with_memory(Handler handler) {
+        return bind_memory(_handler_memory, handler);
+    }
+
+    void received(size_t n) {
+        ++_loop.reads.reads;
+        _loop.reads.bytes += n;
+        char* data = _in.commit(n);
+        for (auto &t : _read_transforms)
+            t->apply(data, n);
+    }
+
+    // Feedback of a read of `room` bytes that returned `n`. Reads clipped
+    // below the current size say nothing about it.
+    void adapt_read_size(size_t room, size_t n) {
+        if (room != _read_size)
+            return;
+        if (n == room) {
+            _read_short = 0;
+            _read_size = std::min(_read_size * 2, _read_max);
+        } else if (n >= room / 2) {
+            _read_short = 0;
+        } else if (++_read_short == 2) {
+            _read_short = 0;
+            _read_size = std::max(_read_size / 2, _read_min);
+        }
+    }
+
+    void encode(char* data, size_t n) {
+        for (auto &t : _write_transforms)
+            t->apply(data, n);
+    }
+
+    void do_read_until(size_t max, int dest_id, size_t searched) {
+        const char* begin = _in.data();
+        const char* end = begin + _in.size();
+        const char* from = begin + searched;
+        const char* found = std::search(from, end,
+            _delim.data(), _delim.data() + _delim.size());
+        size_t limit = max + _delim.size();
+        bool too_long = found == end ? _in.size() >= limit :
+            (size_t)(found - begin) > max;
+        if (found != end || too_long) {
+            auto ec = _read_deadline.finish(std::error_code());
+            if (too_long) {
+                _socket.close();
+                ec = asio::error::message_size;
+            }
+            if (!ec) {
+                push_event(_loop.events, EVT_CONTINUE, dest_id, this, 0,
+                    begin, found - begin, _in.slab());
+                _in.consume(found - begin + _delim.size());
+                _in.release();
+            } else {
+                push_event(_loop.events, EVT_CONTINUE, dest_id, NULL,
+                    error_code_of(ec));
+            }
+            return;
+        }
+        if (_in.size() >= _delim.size())
+            searched = _in.size() - _delim.size() + 1;
+
+        pointer self(this);
+        receive(std::min(_read_size, limit - _in.size()),
+            [self, max, dest_id, searched](std::error_code ec, std::size_t)
+            {
+                if (!ec) {
+                    self->do_read_until(max, dest_id, searched);
+                    return;
+                }
+                ec = self->_read_deadline.finish(ec);
+                self->_socket.close();
+                push_event(self->_loop.events, EVT_CONTINUE, dest_id, NULL,
+                    error_code_of(ec));
+            });
+    }
+
+    // Reads what is available, up to `room` bytes, into the input buffer
+    // and calls handler(ec, bytes). In read-wait mode the buffer is only
+    // borrowed once the socket is readable, so waiting pins none.
+    template <typename Handler>
+    void receive(size_t room, Handler handler) {
+        pointer self(this);
+        auto done = [self, room, handler](std::error_code ec,
+            std::size_t bytes)
+        {
+            self->received(bytes);
+            self->adapt_read_size(room, bytes);
+            handler(ec, bytes);
+        };
+        if (!_read_wait) {
+            char* buff = _in.prepare(room);
+            _socket.async_read_some(asio::buffer(buff, room),
+                asio::bind_cancellation_slot(_read_deadline.signal.slot(),
+                with_memory(done)));
+            return;
+        }
+        _socket.async_wait(tcp::socket::wait_read,
+            asio::bind_cancellation_slot(_read_deadline.signal.slot(),
+            with_memory([self, room, handler, done](std::error_code ec)
+            {
+                if (ec)
+                    return done(ec, 0);
+                char* buff = self->_in.prepare(room);
+                size_t bytes = self->_socket.read_some(
+                    asio::buffer(buff, room), ec);
+                // Readiness was spurious: give the buffer back while the
+                // next wait is pending.
+                if (ec == asio::error::would_block) {
+                    self->_in.release();
+                    return self->receive(room, handler);
+                }
+                done(ec, bytes);
+            })));
+    }
+
+    // Completes a read at once with buffered bytes. The loop holds their
+    // slab until the next batch, so a drained input buffer goes back to the
+    // pool now.
+    bool complete_read(event_message_for_ffi* out, const char* data,
+        size_t size)
+    {
+        auto &views = _loop.views;
+        pool_buffer* slab = _in.slab();
+        if (slab && (views.empty() || views.back().get() != slab))
+            views.push_back(slab);
+        _in.release();
+        return complete_now(out, this, data, size);
+    }
+
+    // Opens the next buffered frame in place and returns its payload, or
+    // NULL when more bytes are needed or `ec` is set.
+    char* open_frame(size_t& size, std::error_code& ec) {
+        if (!_frame_size) {
+            if (_in.size() < FRAME_HEADER)
+                return NULL;
+            uint8_t* header = (uint8_t*)_in.data();
+            bool ok = _frame_opener->open(header, 2, header + 2);
+            size_t len = header[0] << 8 | header[1];
+            if (!ok || len > FRAME_MAX) {
+                ec = std::make_error_code(std::errc::bad_message);
+                return NULL;
+            }
+            _in.consume(FRAME_HEADER);
+            _frame_size = len + chacha20_poly1305::TAG_SIZE;
+        }
+        if (_in.size() < _frame_size)
+            return NULL;
+        char* payload = _in.data();
+        size = _frame_size - chacha20_poly1305::TAG_SIZE;
+        if (!_frame_opener->open((uint8_t*)payload, size,
+            (uint8_t*)payload + size))
+        {
+            ec = std::make_error_code(std::errc::bad_message);
+            return NULL;
+        }
+        _in.consume(_frame_size);
+        _frame_size = 0;
+        return payload;
+    }
+
+    void do_read_frame(int dest_id) {
+        size_t size;
+        std::error_code ec;
+        char* payload = open_frame(size, ec);
+        if (payload || ec) {
+            ec = _read_deadline.finish(ec);
+            if (!ec) {
+                push_event(_loop.events, EVT_CONTINUE, dest_id, this, 0,
+                    payload, size, _in.slab());
+                _in.release();
+            } else {
+                _socket.close();
+                push_event(_loop.events, EVT_CONTINUE, dest_id, NULL,
+                    error_code_of(ec));
+            }
+            return;
+        }
+        pointer self(this);
+        receive(std::max(_read_size, _read_ahead),
+            [self, dest_id](std::error_code ec, std::size_t)
+            {
+                if (!ec) {
+                    self->do_read_frame(dest_id);
+                    return;
+                }
+                ec = self->_read_deadline.finish(ec);
+                self->_socket.close();
+                push_event(self->_loop.events, EVT_CONTINUE, dest_id, NULL,
+                    error_code_of(ec));
+            });
+    }
+
+    template <typename ConstBufferSequence>
+    void do_write(const ConstBufferSequence& buffers, int dest_id,
+        double timeout)
+    {
+        pointer self(this);
+        _write_parked = true;
+        _write_deadline.start(timeout);
+        asio::async_write(_socket, buffers, asio::bind_cancellation_slot(
+            _write_deadline.signal.slot(),
+            with_memory([self, dest_id](std::error_code ec, std::size_t)
+            {
+                ec = self->_write_deadline.finish(ec);
+                self->_write_parked = false;
+                if (!ec) {
+                    push_event(self->_loop.events, EVT_CONTINUE, dest_id,
+                        self.get());
+                } else {
+                    self->_socket.close();
+                    push_event(self->_loop.events, EVT_CONTINUE, dest_id, NULL,
+                    error_code_of(ec));
+                }
+            })));
+    }
+
+    // Writes everything queued, up to MAX_GATHER strings per async_write.
+    void do_send() {
+        pointer self(this);
+        _send_gather.clear();
+        for (auto &chunk : _send_queue) {
+            _send_gather.push_back(asio::buffer(chunk.data, chunk.size));
+            if (_send_gather.size() == MAX_GATHER) break;
+        }
+        _sending = _send_gather.size();
+        asio::async_write(_socket, const_buffers_view(_send_gather),
+            asio::bind_cancellation_slot(_write_deadline.signal.slot(),
+            with_memory([self]
+                (std::error_code ec, std::size_t bytes_transferred)
+            {
+                ec = self->_write_deadline.check(ec);
+                self->_queued_bytes -= bytes_transferred;
+                self->_send_queue.erase(self->_send_queue.begin(),
+                    self->_send_queue.begin() + self->_sending);
+                self->_sending = 0;
+                if (ec) {
+                    self->_socket.close();
+                    self->_send_err = error_code_of(ec);
+                    self->_send_queue.clear();
+                    self->_queued_bytes = 0;
+                }
+                if (self->_drain_waiter >= 0 &&
+                    (ec || self->_queued_bytes <= self->_drain_level))
+                {
+                    self->_write_deadline.finish(ec);
+                    push_event(self->_loop.events, EVT_CONTINUE,
+                        self->_drain_waiter, ec ? NULL : self.get(),
+                        self->_send_err);
+                    self->_drain_waiter = -1;
+                    self->_write_parked = false;
+                }
+                if (!self->_send_queue.empty())
+                    self->do_send();
+            })));
+    }
+
+    // Returns 0 or the send error at once, or -1 when `dest_id` has to
+    // wait until at most `level` bytes are queued.
+    int wait_drain(size_t level, int dest_id, double timeout) {
+        if (_send_err || _queued_bytes <= level)
+            return _send_err;
+        _drain_waiter = dest_id;
+        _drain_level = level;
+        _write_parked = true;
+        _write_deadline.start(timeout);
+        return -1;
+    }
+
+    int already_writing() const {
+        return error_code_of(asio::error::already_started);
+    }
+
+    // Room for `size` bytes at the end of the send queue, appended to the
+    // last queued chunk while it is not being written and has room.
+    char* queue_room(size_t size) {
+        _queued_bytes += size;
+        if (_send_queue.size() > _sending) {
+            auto &last = _send_queue.back();
+            if (last.buf && last.buf->capacity - last.size >= size) {
+                char* dest = last.buf->data() + last.size;
+                last.size += size;
+                return dest;
+            }
+        }
+        pool_buffer* buf = _loop.buffers.acquire(
+            std::max(size, COALESCE_SIZE));
+        send_chunk chunk = { buf, buf->data(), size };
+        _send_queue.push_back(chunk);
+        return buf->data();
+    }
+
+    // Copies the pieces once into the send queue. Borrowed pieces are
+    // queued as is and the caller waits until they are written. Write
+    // transforms always need a copy.
+    int enqueue(const char** datas, const size_t* sizes, int count,
+        bool borrow, int dest_id, double timeout)
+    {
+        if (_send_err)
+            return _send_err;
+        if (!_write_transforms.empty())
+            borrow = false;
+        for (int i = 0; i < count; ++i) {
+            size_t size = sizes[i];
+            if (borrow) {
+                _queued_bytes += size;
+                send_chunk chunk = { NULL, datas[i], size };
+                _send_queue.push_back(chunk);
+                continue;
+            }
+            char* dest = queue_room(size);
+            memcpy(dest, datas[i], size);
+            encode(dest, size);
+        }
+        if (!_sending)
+            do_send();
+        size_t level = _pipelined && !borrow ? _send_hwm : 0;
+        return wait_drain(level, dest_id, timeout);
+    }
+
+    void do_connect(const tcp::endpoint& endpoint, int dest_id,
+        double timeout)
+    {
+        pointer self(this);
+        _write_deadline.start(timeout);
+        _socket.async_connect(endpoint, asio::bind_cancellation_slot(
+            _write_deadline.signal.slot(),
+            with_memory([self, dest_id](std::error_code ec)
+            {
+                ec = self->_write_deadline.finish(ec);
+                if (ec)
+                    self->_socket.close();
+                push_event(self->_loop.events, EVT_CONTINUE, dest_id,
+                    ec ? NULL : self.get(), error_code_of(ec));
+            })));
+    }
+
+public:
+    typedef boost::intrusive_ptr<connection> pointer;
+
+    connection(asio_loop& loop, const tcp::endpoint& endpoint, int dest_id,
+        double timeout)
+        : _loop(loop), _socket(loop.io), _in(loop.buffers),
+          _read_deadline(loop.timers), _write_deadline(loop.timers),
+          _handler_memory(loop.handlers)
+    {
+        do_connect(endpoint, dest_id, timeout);
+    }
+
+    connection(asio_loop& loop, tcp::socket socket)
+        : _loop(loop), _socket(std::move(socket)), _in(loop.buffers),
+          _read_deadline(loop.timers), _write_deadline(loop.timers),
+          _handler_memory(loop.handlers)
+    {
+    }
+
+    // Writes return 0 or an error when they completed at once, -1 when the
+    // caller waits for the completion event. Data is borrowed while the
+    // caller waits, so only pipelined writes that return at once copy it,
+    // and writes through transforms. `borrow` forces waiting instead, for
+    // memory the caller owns.
+    // While another light thread waits in a write, writes fail with
+    // already_started.
+    int write(const char* data, size_t size, bool borrow, int dest_id,
+        double timeout)
+    {
+        if (_write_parked)
+            return already_writing();
+        if (_pipelined || !_send_queue.empty() || !_write_transforms.empty())
+            return enqueue(&data, &size, 1, borrow || !_pipelined,
+                dest_id, timeout);
+        do_write(asio::buffer(data, size), dest_id, timeout);
+        return -1;
+    }
+
+    // Gathers all pieces into a single send.
+    int writev(const char** datas, const size_t* sizes, int count,
+        int dest_id, double timeout)
+    {
+        if (_write_parked)
+            return already_writing();
+        if (_pipelined || !_send_queue.empty() || !_write_transforms.empty())
+            return enqueue(datas, sizes, count, !_pipelined,
+                dest_id, timeout);
+        _gather.clear();
+        for (int i = 0; i < count; ++i)
+            _gather.push_back(asio::buffer(datas[i], sizes[i]));
+        do_write(const_buffers_view(_gather), dest_id, timeout);
+        return -1;
+    }
+
+    // Seals the data into frames of at most FRAME_MAX bytes, queued like
+    // pipelined writes.
+    int write_frame(const char* data, size_t size, int dest_id,
+        double timeout)
+    {
+        if (!_frame_sealer)
+            return error_code_of(asio::error::operation_not_supported);
+        if (_write_parked)
+            return already_writing();
+        if (_send_err)
+            return _send_err;
+        do {
+            size_t len = std::min(size, FRAME_MAX);
+            size_t sealed = FRAME_HEADER + len + chacha20_poly1305::TAG_SIZE;
+            uint8_t* frame = (uint8_t*)queue_room(sealed);
+            frame[0] = (uint8_t)(len >> 8);
+            frame[1] = (uint8_t)len;
+            _frame_sealer->seal(frame, 2, frame + 2);
+            uint8_t* payload = frame + FRAME_HEADER;
+            memcpy(payload, data, len);
+            _frame_sealer->seal(payload, len, payload + len);
+            encode((char*)frame, sealed);
+            data += len;
+            size -= len;
+        } while (size);
+        if (!_sending)
+            do_send();
+        return wait_drain(_pipelined ? _send_hwm : 0, dest_id, timeout);
+    }
+
+    // Keys for write_frame and read_frame, 32 bytes each.
+    void set_aead(const char* send_key, const char* recv_key) {
+        _frame_sealer.reset(new chacha20_poly1305(send_key));
+        _frame_opener.reset(new chacha20_poly1305(recv_key));
+        _frame_size = 0;
+    }
+
+    // Pipelined mode: writes are queued and coalesced, the caller only
+    // waits while more than `high_watermark` bytes are queued.
+    void set_pipelined(bool on, size_t high_watermark) {
+        _pipelined = on;
+        _send_hwm = high_watermark;
+    }
+
+    // Waits until everything queued has been written.
+    int flush(int dest_id, double timeout) {
+        if (_write_parked)
+            return already_writing();
+        return wait_drain(0, dest_id, timeout);
+    }
+
+    // Buffered bytes are delivered first, e.g. those left by read_until,
+    // and then the call completes at once through `out` and returns true.
+    // With read-ahead on, reads pull in as much as is available.
+    bool read(size_t size, int dest_id, double timeout,
+        event_message_for_ffi* out)
+    {
+        size_t have = _in.size();
+        if (have >= size) {
+            const char* data = _in.data();
+            _in.consume(size);
+            return complete_read(out, data, size);
+        }
+        pointer self(this);
+        size_t need = size - have;
+        size_t room = std::max(need, _read_ahead);
+        char* buff = _in.prepare(room);
+        _read_deadline.start(timeout);
+        asio::async_read(_socket, asio::buffer(buff, room),
+            asio::transfer_at_least(need),
+            asio::bind_cancellation_slot(_read_deadline.signal.slot(),
+            with_memory([self, dest_id, size]
+                (std::error_code ec, std::size_t bytes)
+            {
+                ec = self->_read_deadline.finish(ec);
+                self->received(bytes);
+                if (!ec) {
+                    push_event(self->_loop.events, EVT_CONTINUE, dest_id,
+                        self.get(), 0, self->_in.data(), size,
+                        self->_in.slab());
+                    self->_in.consume(size);
+                    self->_in.release();
+                } else {
+                    self->_socket.close();
+                    push_event(self->_loop.events, EVT_CONTINUE, dest_id, NULL,
+                    error_code_of(ec));
+                }
+            })));
+        return false;
+    }
+
+    bool read_some(int dest_id, double timeout, event_message_for_ffi* out) {
+        size_t have = _in.size();
+        if (have) {
+            const char* data = _in.data();
+            _in.consume(have);
+            return complete_read(out, data, have);
+        }
+        pointer self(this);
+        _read_deadline.start(timeout);
+        receive(_read_ahead ? _read_ahead : _read_size,
+            [self, dest_id](std::error_code ec, std::size_t bytes_transferred)
+            {
+                ec = self->_read_deadline.finish(ec);
+                if (ec)
+                    self->_socket.close();
+                push_event(self->_loop.events, EVT_CONTINUE, dest_id,
+                    ec ? NULL : self.get(), error_code_of(ec),
+                    self->_in.data(), bytes_transferred, self->_in.slab());
+                self->_in.consume(bytes_transferred);
+                self->_in.release();
+            });
+        return false;
+    }
+
+    // Delivers the payload of the next frame. A frame failing to
+    // authenticate closes the connection with bad_message.
+    bool read_frame(int dest_id, double timeout, event_message_for_ffi* out)
+    {
+        if (!_frame_opener)
+            return fail_now(out,
+                error_code_of(asio::error::operation_not_supported));
+        size_t size;
+        std::error_code ec;
+        char* payload = open_frame(size, ec);
+        if (ec) {
+            _socket.close();
+            return fail_now(out, error_code_of(ec));
+        }
+        if (payload)
+            return complete_read(out, payload, size);
+        _read_deadline.start(timeout);
+        do_read_frame(dest_id);
+        return false;
+    }
+
+    // Appends a stage to the read or write side. Bytes already buffered or
+    // queued are not transformed.
+    void add_transform(bool write, stream_transform* t) {
+        (write ? _write_transforms : _read_transforms).push_back(
+            transform_ptr(t));
+    }
+
+    // Read-wait mode: adaptive reads wait for readability before they
+    // borrow a buffer, then read without blocking.
+    void set_read_wait(bool on) {
+        std::error_code ec;
+        _socket.non_blocking(on, ec);
+        _read_wait = on && !ec;
+    }
+
+    // Bounds of the adaptive read size.
+    void set_read_size(size_t min, size_t max) {
+        _read_min = min;
+        _read_max = max;
+        _read_size = std::min(std::max(_read_size, min), max);
+        _read_short = 0;
+    }
+
+    // Size of the read-ahead buffer, 0 to read exactly what is asked for.
+    void set_read_ahead(size_t size) {
+        _read_ahead = size;
+    }
+
+    // Delivers the bytes before `delim` and drops the delimiter; bytes past
+    // it stay buffered for the next read. Fails with message_size when more
+    // than `max` bytes come before the delimiter.
+    bool read_until(const char* delim, size_t delim_len, size_t max,
+        int dest_id, double timeout, event_message_for_ffi* out)
+    {
+        const char* begin = _in.data();
+        const char* end = begin + _in.size();
+        const char* found = std::search(begin, end, delim, delim + delim_len);
+        if (found != end && (size_t)(found - begin) > max) {
+            _socket.close();
+            return fail_now(out, error_code_of(asio::error::message_size));
+        }
+        if (found != end) {
+            _in.consume(found - begin + delim_len);
+            return complete_read(out, begin, found - begin);
+        }
+        _delim.assign(delim, delim_len);
+        _read_deadline.start(timeout);
+        do_read_until(max, dest_id,
+            _in.size() >= delim_len ? _in.size() - delim_len + 1 : 0);
+        return false;
+    }
+
+    void close() {
+        _socket.close();
+    }
+
+    // Gives the socket up so another loop can adopt it. Buffered or queued
+    // data and transforms would not follow it, so those refuse.
+    std::error_code release_socket(tcp::socket::native_handle_type& fd,
+        bool& v6)
+    {
+        if (_in.size() || !_send_queue.empty() || _frame_sealer ||
+            !_read_transforms.empty() || !_write_transforms.empty())
+        {
+            return asio::error::operation_not_supported;
+        }
+        std::error_code ec;
+        v6 = _socket.local_endpoint(ec).address().is_v6();
+        if (!ec)
+            fd = _socket.release(ec);
+        return ec;
+    }
+
+    void restore_socket(tcp::socket::native_handle_type fd, bool v6) {
+        std::error_code ec;
+        _socket.assign(v6 ? tcp::v6() : tcp::v4(), fd, ec);
+    }
+
+    // Returns 0 or the error of setting socket_option_id `opt`.
+    int setopt(int opt, int value) {
+        return error_code_of(set_socket_option(_socket, opt, value));
+    }
+
+    bool get_original_dst(struct sockaddr_storage *destaddr) {
+#ifdef _WINDOWS
+        return false;
+#else
+        socklen_t size = sizeof(sockaddr_storage);
+        int fd    = _socket.native_handle();
+        int error = getsockopt( fd, SOL_IPV6, IP6T_SO_ORIGINAL_DST, destaddr, &size);
+        if (error) {
+            error = getsockopt( fd, SOL_IP, SO_ORIGINAL_DST, destaddr, &size);
+            if (error) {
+                return false;
+            }
+        }
+        return true;
+#endif
+    }
+
+};
+
+//--------------------------forward--------------------------
+
+// Relays bytes from one connection to another, in one or both directions,
+// without entering Lua. On Linux the bytes move with splice() through a
+// pipe and never reach user space; elsewhere, when no pipe can be made or
+// when the connections have transforms, each direction reuses one buffer. Completes when every direction ended;
+// in both-directions mode the first end closes both connections.
+class forwarder : public boost::enable_shared_from_this<forwarder> {
+private:
+    struct relay {
+        connection::pointer from;
+        connection::pointer to;
+        int pipe[2];
+        size_t in_pipe;
+        vector<char> buff;
+        uint64_t bytes;
+    };
+
+    relay _relays[2];
+    int _count;
+    int _running;
+    int _dest_id;
+    bool _ended = false;
+    std::error_code _ec;
+    handler_memory _handler_memory;
+    static const size_t CHUNK_SIZE = 65536;
+    static const size_t SPLICE_BUDGET = 4 * CHUNK_SIZE;
+
+    // Ends relay `r`, whose pipe is not needed any more.
+    void end(relay* r, std::error_code ec) {
+#ifdef __linux__
+        for (auto &fd : r->pipe) {
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+#endif
+        if (!_ended) {
+            _ended = true;
+            if (ec != asio::error::eof)
+                _ec = ec;
+            if (_count == 2) {
+                _relays[0].from->close();
+                _relays[1].from->close();
+            }
+        }
+        if (--_running) return;
+        uint64_t bytes[2] = { _relays[0].bytes, _relays[1].bytes };
+        push_event_inline(_relays[0].from->_loop.events, EVT_CONTINUE,
+            _dest_id, NULL, error_code_of(_ec), bytes, sizeof(bytes));
+    }
+
+    // Bytes the source connection buffered but Lua did not read yet.
+    void send_buffered(relay* r) {
+        auto &in = r->from->_in;
+        size_t have = in.size();
+        if (!have)
+            return pump(r);
+        auto self = shared_from_this();
+        r->to->encode((char*)in.data(), have);
+        asio::async_write(r->to->_socket, asio::buffer(in.data(), have),
+            bind_memory(self->_handler_memory,
+                [self, r](std::error_code ec, std::size_t bytes_transferred)
+            {
+                r->from->_in.consume(bytes_transferred);
+                r->from->_in.release();
+                r->bytes += bytes_transferred;
+                if (ec)
+                    return self->end(r, ec);
+                self->pump(r);
+            }));
+    }
+
+    void pump(relay* r) {
+#ifdef __linux__
+        if (r->pipe[0] >= 0)
+            return splice(r);
+#endif
+        read_some(r);
+    }
+
+#ifdef __linux__
+    void wait(relay* r, tcp::socket& socket, tcp::socket::wait_type type) {
+        auto self = shared_from_this();
+        socket.async_wait(type, bind_memory(self->_handler_memory,
+            [self, r](std::error_code ec)
+        {
+            if (ec)
+                return self->end(r, ec);
+            self->splice(r);
+        }));
+    }
+
+    // Lets the other handlers of the loop run before splicing on.
+    void yield(relay* r) {
+        auto self = shared_from_this();
+        asio::post(r->from->_socket.get_executor(),
+            bind_memory(self->_handler_memory, [self, r]() {
+                self->splice(r);
+            }));
+    }
+
+    // Moves bytes source -> pipe -> destination until a socket would block,
+    // or yields after SPLICE_BUDGET bytes so one fast relay does not keep
+    // the loop to itself.
+    void splice(relay* r) {
+        size_t moved = 0;
+        for (;;) {
+            if (!r->in_pipe) {
+                if (moved >= SPLICE_BUDGET)
+                    return yield(r);
+                ssize_t n = ::splice(r->from->_socket.native_handle(), NULL,
+                    r->pipe[1], NULL, CHUNK_SIZE,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n == 0)
+                    return end(r, asio::error::eof);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return wait(r, r->from->_socket,
+                            tcp::socket::wait_read);
+                    return end(r, std::error_code(errno,
+                        asio::system_category()));
+                }
+                r->in_pipe = n;
+            }
+            ssize_t n = ::splice(r->pipe[0], NULL,
+                r->to->_socket.native_handle(), NULL, r->in_pipe,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return wait(r, r->to->_socket, tcp::socket::wait_write);
+                return end(r, std::error_code(errno, asio::system_category()));
+            }
+            r->in_pipe -= n;
+            r->bytes += n;
+            moved += n;
+        }
+    }
+#endif
+
+    void read_some(relay* r) {
+        auto self = shared_from_this();
+        r->buff.resize(CHUNK_SIZE);
+        r->from->_socket.async_read_some(asio::buffer(r->buff),
+            bind_memory(self->_handler_memory,
+                [self, r](std::error_code ec, std::size_t bytes_transferred)
+            {
+                if (ec)
+                    return self->end(r, ec);
+                for (auto &t : r->from->_read_transforms)
+                    t->apply(r->buff.data(), bytes_transferred);
+                r->to->encode(r->buff.data(), bytes_transferred);
+                self->write(r, bytes_transferred);
+            }));
+    }
+
+    void write(relay* r, size_t size) {
+        auto self = shared_from_this();
+        asio::async_write(r->to->_socket, asio::buffer(r->buff.data(), size),
+            bind_memory(self->_handler_memory,
+                [self, r](std::error_code ec, std::size_t bytes_transferred)
+            {
+                r->bytes += bytes_transferred;
+                if (ec)
+                    return self->end(r, ec);
+                self->read_some(r);
+            }));
+    }
+
+public:
+    forwarder(connection::pointer a, connection::pointer b, bool both,
+        int dest_id)
+        : _count(both ? 2 : 1), _running(_count), _dest_id(dest_id),
+          _handler_memory(a->_loop.handlers)
+    {
+        for (int i = 0; i < 2; ++i) {
+            auto &r = _relays[i];
+            r.from = i ? b : a;
+            r.to = i ? a : b;
+            r.pipe[0] = r.pipe[1] = -1;
+            r.in_pipe = 0;
+            r.bytes = 0;
+        }
+    }
+
+    ~forwarder() {
+#ifdef __linux__
+        for (auto &r : _relays) {
+            if (r.pipe[0] >= 0) ::close(r.pipe[0]);
+            if (r.pipe[1] >= 0) ::close(r.pipe[1]);
+        }
+#endif
+    }
+
+    void start() {
+        for (int i = 0; i < _count; ++i) {
+            auto r = &_relays[i];
+#ifdef __linux__
+            std::error_code ec;
+            bool plain = r->from->_read_transforms.empty() &&
+                r->to->_write_transforms.empty();
+            if (plain)
+                r->from->_socket.native_non_blocking(true, ec);
+            if (plain && !ec)
+                r->to->_socket.native_non_blocking(true, ec);
+            if (!plain || ec || pipe2(r->pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+                r->pipe[0] = r->pipe[1] = -1;
+#endif
+            send_buffered(r);
+        }
+    }
+};
+
+//--------------------------server--------------------------
+
+// Options of the listening socket itself, numbered after socket_option_id.
+enum server_option_id {
+    SRV_BACKLOG = OPT_COUNT,
+    SRV_ACCEPT_BATCH,
+};
+
+// Returns the server_option_id or socket_option_id named `name`, -1 for an
+// unknown name.
+int server_option_of(const char* name) {
+    if (!strcmp(name, "backlog"))
+        return SRV_BACKLOG;
+    if (!strcmp(name, "accept_batch"))
+        return SRV_ACCEPT_BATCH;
+    return socket_option_of(name);
+}
+
+class server{
+private:
+    asio_loop& _loop;
+    tcp::acceptor _acceptor;
+    vector<pair<int, int> > _options;
+    int _accept_batch = 1;
+    // Bumped when accept_batch switches modes. A handler armed before that
+    // only finishes its own work and leaves re-arming to the new chain.
+    unsigned _accept_gen = 0;
+
+    // Handles of one EVT_ACCEPT_BATCH event.
+    static const int BATCH_HANDLES = EVT_INLINE_SIZE / sizeof(conn_handle);
+
+private:
+    conn_handle add_connection(tcp::socket socket) {
+        for (auto &opt : _options)
+            set_socket_option(socket, opt.first, opt.second);
+        return _loop.handles.add(new connection(_loop, std::move(socket)));
+    }
+
+    void push_accepted(const conn_handle* handles, int n) {
+        if (n) {
+            push_event_inline(_loop.events, EVT_ACCEPT_BATCH, port, NULL, 0,
+                handles, n * sizeof(conn_handle));
+        }
+    }
+
+    void do_accept() {
+        if (_accept_batch > 1) {
+            do_accept_batch();
+            return;
+        }
+        unsigned gen = _accept_gen;
+        _acceptor.async_accept([this, gen](std::error_code ec,
+            tcp::socket socket)
+        {
+            if (!ec) {
+                ++_loop.accepts.wakeups;
+                ++_loop.accepts.accepts;
+                conn_handle handle = add_connection(std::move(socket));
+                if (handle) {
+                    push_event_inline(_loop.events, EVT_ACCEPT, port, NULL,
+                        0, &handle, sizeof(handle));
+                }
+            } else if(ec == asio::error::operation_aborted ) {
+                return;
+            }
+
+            if (gen == _accept_gen)
+                do_accept();
+        });
+    }
+
+    // Waits until the listening socket is readable, then accepts without
+    // blocking until the backlog is empty or _accept_batch connections were
+    // taken, and queues their handles BATCH_HANDLES per event.
+    void do_accept_batch() {
+        unsigned gen = _accept_gen;
+        _acceptor.async_wait(tcp::acceptor::wait_read,
+            [this, gen](std::error_code ec)
+        {
+            if (ec == asio::error::operation_aborted || gen != _accept_gen)
+                return;
+            conn_handle handles[BATCH_HANDLES];
+            int n = 0;
+            ++_loop.accepts.wakeups;
+            for (int i = 0; i < _accept_batch; ++i) {
+                tcp::socket socket(_loop.io);
+                _acceptor.accept(socket, ec);
+                if (ec)
+                    break;
+                ++_loop.accepts.accepts;
+                conn_handle handle = add_connection(std::move(socket));
+                if (handle)
+                    handles[n++] = handle;
+                if (n == BATCH_HANDLES) {
+                    push_accepted(handles, n);
+                    n = 0;
+                }
+            }
+            push_accepted(handles, n);
+
+            do_accept();
+        });
+    }
+
+    static tcp::acceptor open_acceptor(asio::io_context& io_context,
+        const tcp::endpoint& endpoint, bool reuse_port)
+    {
+        tcp::acceptor acceptor(io_context, endpoint.protocol());
+#ifndef _WINDOWS
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        if (reuse_port) {
+            acceptor.set_option(asio::detail::socket_option::boolean<
+                SOL_SOCKET, SO_REUSEPORT>(true));
+        }
+#endif
+        acceptor.bind(endpoint);
+        acceptor.listen();
+        return acceptor;
+    }
+
+public:
+
+    int port;
+
+    // With `reuse_port` several servers, one per thread, share the port and
+    // the kernel spreads the connections between them.
+    server(asio_loop& loop, const asio::ip::address &ip, int port,
+        bool reuse_port = false)
+        : _loop(loop),
+          _acceptor(open_acceptor(loop.io, tcp::endpoint(ip, port),
+            reuse_port)),
+          port(port)
+    {
+        do_accept();
+    }
+
+    // Applies server_option_id `opt` to the listening socket, or sets
+    // socket_option_id `opt` on every connection accepted from now on.
+    void set_option(int opt, int value) {
+        std::error_code ec;
+        if (opt == SRV_BACKLOG) {
+            _acceptor.listen(value, ec);
+            return;
+        }
+        if (opt == SRV_ACCEPT_BATCH) {
+            bool batched = _accept_batch > 1;
+            _accept_batch = std::max(value, 1);
+            _acceptor.non_blocking(_accept_batch > 1, ec);
+            // Re-arm the pending accept or wait in the new mode, so the
+            // next wakeup already batches.
+            if (batched != (_accept_batch > 1)) {
+                ++_accept_gen;
+                _acceptor.cancel(ec);
+                do_accept();
+            }
+            return;
+        }
+        for (auto &o : _options) {
+            if (o.first == opt) {
+                o.second = value;
+                return;
+            }
+        }
+        _options.push_back(make_pair(opt, value));
+    }
+
+};
+
+//--------------------------channel--------------------------
+
+// A string in an unpooled buffer, or a socket moving to another loop.
+struct channel_message {
+    pool_buffer* buf;
+    size_t size;
+    tcp::socket::native_handle_type fd;
+    bool v6;
+};
+
+// Bounded multi-producer single-consumer ring (Vyukov's queue): producers
+// claim a cell with a CAS on _tail, the one consumer owns _head. Each cell's
+// sequence number says whether it is free or filled for the current lap.
+class mpsc_ring {
+public:
+    explicit mpsc_ring(size_t capacity) : _cells(capacity), _mask(capacity - 1)
+    {
+        for (size_t i = 0; i < capacity; ++i)
+            _cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // Returns false when full.
+    bool push(const channel_message& msg) {
+        size_t pos = _tail.load(std::memory_order_relaxed);
+        for (;;) {
+            cell& c = _cells[pos & _mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + 1,
+                    std::memory_order_relaxed))
+                {
+                    c.msg = msg;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = _tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool empty() const {
+        const cell& c = _cells[_head & _mask];
+        return c.seq.load(std::memory_order_acquire) != _head + 1;
+    }
+
+    bool pop(channel_message& msg) {
+        if (empty())
+            return false;
+        cell& c = _cells[_head & _mask];
+        msg = c.msg;
+        c.seq.store(_head + _mask + 1, std::memory_order_release);
+        ++_head;
+        return true;
+    }
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        channel_message msg;
+    };
+
+    // Producers and the consumer write on separate cache lines.
+    vector<cell> _cells;
+    size_t _mask;
+    std::atomic<size_t> _tail{0};
+    char _pad[64];
+    size_t _head = 0;
+};
+
+// Named channel between the loops of a process. Any thread sends without
+// blocking; one loop at a time receives. A receiver that finds it empty
+// parks its light thread, and the next send posts the delivery to that
+// loop's io_context. Channels live until the process exits.
+class channel {
+public:
+    channel(size_t capacity) : _ring(capacity) {}
+
+    bool send(const channel_message& msg) {
+        if (!_ring.push(msg))
+            return false;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_waiter.load(std::memory_order_relaxed))
+            wake();
+        return true;
+    }
+
+    // Takes the next message for `loop`. Returns false without error when
+    // the light thread `dest_id` waits for its EVT_CONTINUE instead.
+    bool recv(asio_loop& loop, int dest_id, channel_message& msg,
+        std::error_code& ec)
+    {
+        asio_loop* owner = NULL;
+        if ((!_owner.compare_exchange_strong(owner, &loop) && owner != &loop)
+            || _waiter_id >= 0)
+        {
+            ec = asio::error::already_started;
+            return false;
+        }
+        _current.reset();
+        if (_ring.pop(msg))
+            return true;
+        _waiter_id = dest_id;
+        _waiter.store(&loop);
+        // A send that raced with parking may have missed the flag.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!_ring.empty() && unpark(loop)) {
+            _waiter_id = -1;
+            return _ring.pop(msg);
+        }
+        return false;
+    }
+
+    // Called when `loop` stops receiving, e.g. its Lua state closes.
+    void detach(asio_loop& loop) {
+        if (_owner.load() != &loop)
+            return;
+        unpark(loop);
+        // A sender that took the waiter may still be posting to `loop`.
+        while (_wakers.load())
+            std::this_thread::yield();
+        _waiter_id = -1;
+        _current.reset();
+        _owner.store(NULL);
     }
 
-    void write(const string& data, int dest_id) {
-        auto self = shared_from_this();
-        shared_const_buffer buffer(data);
-        asio::async_write(_socket, buffer,
-            [self, dest_id](std::error_code ec, std::size_t)
-            {
-                if (!ec) {
-                    push_event(EVT_CONTINUE, dest_id, self.get(), "");
-                } else {
-                    self->_socket.close();
-                    push_event(EVT_CONTINUE, dest_id, NULL, ec.message());
-                }
-            });
+    // Keeps the payload of a message returned at once valid until the next
+    // recv.
+    void hold(pool_buffer* buf) {
+        _current = buf;
     }
 
-    void read(size_t size, int dest_id) {
-        auto self = shared_from_this();
-        _read_buff.resize(size);
-        if (_read_buff.capacity() > MAX_BUFF_SIZE)
-            _read_buff.shrink_to_fit();
-        asio::async_read(_socket, asio::buffer(_read_buff),
-            [self, dest_id](std::error_code ec, std::size_t)
-            {
-                if (!ec) {
-                    push_event(EVT_CONTINUE, dest_id, self.get(), self->_read_buff);
-                } else {
-                    self->_socket.close();
-                    push_event(EVT_CONTINUE, dest_id, NULL, ec.message());
-                }
-            });
+    const char* hold(conn_handle handle) {
+        _handle = handle;
+        return (const char*)&_handle;
     }
 
-    void read_some(int dest_id) {
-        auto self = shared_from_this();
-        _read_buff.resize(MAX_BUFF_SIZE);
-        _read_buff.shrink_to_fit();
-        _socket.async_read_some(asio::buffer(_read_buff),
-            [self, dest_id](std::error_code ec, std::size_t bytes_transferred)
-            {
-                if (!ec) {
-                    self->_read_buff.resize(bytes_transferred);
-                    push_event(EVT_CONTINUE, dest_id, self.get(), self->_read_buff);
-                } else {
-                    self->_socket.close();
-                    self->_read_buff.resize(bytes_transferred);
-                    push_event(EVT_CONTINUE, dest_id, NULL, self->_read_buff);
-                    push_event(EVT_CONTINUE, dest_id, NULL, ec.message());
-                }
-            });
+private:
+    mpsc_ring _ring;
+    std::atomic<asio_loop*> _owner{NULL};
+    // The parked receiver's loop. Whoever exchanges it for NULL first, a
+    // sender or the receiver itself, resumes the receiver.
+    std::atomic<asio_loop*> _waiter{NULL};
+    std::atomic<int> _wakers{0};
+
+    // Owned by the receiving loop's thread.
+    int _waiter_id = -1;
+    boost::intrusive_ptr<pool_buffer> _current;
+    conn_handle _handle = 0;
+
+    bool unpark(asio_loop& loop) {
+        asio_loop* expected = &loop;
+        return _waiter.compare_exchange_strong(expected, NULL);
     }
 
-    void close() {
-        _socket.close();
+    void wake() {
+        ++_wakers;
+        asio_loop* loop = _waiter.exchange(NULL);
+        if (loop)
+            asio::post(loop->io, [this, loop]() { deliver(*loop); });
+        --_wakers;
     }
 
-    bool get_original_dst(struct sockaddr_storage *destaddr) {
+    void deliver(asio_loop& loop);
+};
+
+// Adopts the socket of a received message into `loop`. Returns its handle,
+// 0 for a string message or on error.
+conn_handle adopt_message(asio_loop& loop, const channel_message& msg,
+    int& err)
+{
+    err = 0;
+    if (msg.buf)
+        return 0;
+    tcp::socket socket(loop.io);
+    std::error_code ec;
+    socket.assign(msg.v6 ? tcp::v6() : tcp::v4(), msg.fd, ec);
+    if (ec) {
 #ifdef _WINDOWS
-        return false;
+        ::closesocket(msg.fd);
 #else
-        socklen_t size = sizeof(sockaddr_storage);
-        int fd    = _socket.native_handle();
-        int error = getsockopt( fd, SOL_IPV6, IP6T_SO_ORIGINAL_DST, destaddr, &size);
-        if (error) {
-            error = getsockopt( fd, SOL_IP, SO_ORIGINAL_DST, destaddr, &size);
-            if (error) {
-                return false;
-            }
-        }
-        return true;
+        ::close(msg.fd);
 #endif
+        err = error_code_of(ec);
+        return 0;
     }
+    conn_handle handle = loop.handles.add(
+        new connection(loop, std::move(socket)));
+    if (!handle)
+        err = error_code_of(asio::error::no_buffer_space);
+    return handle;
+}
 
-};
+void channel::deliver(asio_loop& loop) {
+    channel_message msg;
+    if (_owner.load() != &loop || _waiter_id < 0 || !_ring.pop(msg))
+        return;
+    int dest_id = _waiter_id;
+    _waiter_id = -1;
+    int err;
+    conn_handle handle = adopt_message(loop, msg, err);
+    if (msg.buf) {
+        push_event(loop.events, EVT_CONTINUE, dest_id, NULL, 0,
+            msg.buf->data(), msg.size, msg.buf);
+    } else if (err) {
+        push_event(loop.events, EVT_CONTINUE, dest_id, NULL, err);
+    } else {
+        push_event_inline(loop.events, EVT_CONTINUE, dest_id, this, 0,
+            &handle, sizeof(handle));
+    }
+}
 
-//--------------------------server--------------------------
+class channel_registry {
+public:
+    channel* open(const string& name, size_t capacity) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &ch = _channels[name];
+        if (!ch) {
+            size_t size = 2;
+            while (size < capacity)
+                size *= 2;
+            ch.reset(new channel(size));
+        }
+        return ch.get();
+    }
 
-class server{
 private:
-    tcp::acceptor _acceptor;
+    std::mutex _mutex;
+    map<string, std::unique_ptr<channel> > _channels;
+};
+
+//--------------------------workers--------------------------
+
+#ifndef _WINDOWS
+
+// The Lua C API, taken from the host process (the luajit executable exports
+// it) or else from the LuaJIT shared library.
+struct lua_State;
+
+struct lua_api {
+    lua_State* (*newstate)();
+    void (*openlibs)(lua_State* L);
+    int (*loadbuffer)(lua_State* L, const char* buff, size_t size,
+        const char* name);
+    void (*pushlstring)(lua_State* L, const char* s, size_t len);
+    int (*pcall)(lua_State* L, int nargs, int nresults, int errfunc);
+    const char* (*tolstring)(lua_State* L, int idx, size_t* len);
+    void (*close)(lua_State* L);
+
+    static void* symbol(const char* name) {
+        static const char* const LIBS[] = {
+            "libluajit-5.1.so.2", "libluajit-5.1.so",
+            "libluajit-5.1.2.dylib", "libluajit-5.1.dylib" };
+        void* sym = dlsym(RTLD_DEFAULT, name);
+        for (size_t i = 0; !sym && i < sizeof(LIBS) / sizeof(LIBS[0]); ++i) {
+            void* lib = dlopen(LIBS[i], RTLD_NOW | RTLD_GLOBAL);
+            if (lib)
+                sym = dlsym(lib, name);
+        }
+        return sym;
+    }
+
+    bool load() {
+        *(void**)&newstate = symbol("luaL_newstate");
+        *(void**)&openlibs = symbol("luaL_openlibs");
+        *(void**)&loadbuffer = symbol("luaL_loadbuffer");
+        *(void**)&pushlstring = symbol("lua_pushlstring");
+        *(void**)&pcall = symbol("lua_pcall");
+        *(void**)&tolstring = symbol("lua_tolstring");
+        *(void**)&close = symbol("lua_close");
+        return newstate && openlibs && loadbuffer && pushlstring && pcall &&
+            tolstring && close;
+    }
+};
 
+// Serves one port from `count` threads. Every thread has its own
+// asio_loop, its own reuse-port server and its own Lua state, which runs
+// the `boot` chunk with the string arguments `args` followed by the address
+// of the thread's loop. The chunk runs that loop until the pool is deleted.
+// The pool also keeps the creating loop running meanwhile.
+class worker_pool {
 private:
-    void do_accept() {
-        _acceptor.async_accept([this](std::error_code ec, tcp::socket socket)
+    struct worker {
+        std::thread thread;
+        asio_loop* loop = NULL;
+    };
+
+    asio::ip::address _ip;
+    int _port;
+    vector<pair<int, int> > _options;
+    string _boot;
+    vector<string> _args;
+    vector<worker> _workers;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    int _started = 0;
+    bool _failed = false;
+    asio::executor_work_guard<asio::io_context::executor_type> _hold;
+
+    void run(worker* w, const lua_api& lua) {
+        asio_loop loop;
+        auto hold = asio::make_work_guard(loop.io);
+        server* svr = NULL;
+        try {
+            svr = new server(loop, _ip, _port, true);
+            for (auto &opt : _options)
+                svr->set_option(opt.first, opt.second);
+        } catch (std::exception& e) {
+            std::cerr << "LuaAsio Exception worker: " << e.what() << "\n";
+        }
         {
-            if (!ec) {
-                auto conn = new boost::shared_ptr<connection>(
-                    new connection(std::move(socket)) );
-                push_event(EVT_ACCEPT, port, conn, "");
-            } else if(ec == asio::error::operation_aborted ) {
-                return;
-            }
+            std::lock_guard<std::mutex> lock(_mutex);
+            w->loop = &loop;
+            _failed |= !svr;
+            ++_started;
+        }
+        _cond.notify_all();
 
-            do_accept();
-        });
+        if (svr) {
+            lua_State* L = lua.newstate();
+            lua.openlibs(L);
+            int rc = lua.loadbuffer(L, _boot.data(), _boot.size(),
+                "=asio worker");
+            if (!rc) {
+                for (auto &arg : _args)
+                    lua.pushlstring(L, arg.data(), arg.size());
+                string addr = std::to_string((uintptr_t)&loop);
+                lua.pushlstring(L, addr.data(), addr.size());
+                rc = lua.pcall(L, (int)_args.size() + 1, 0, 0);
+            }
+            if (rc) {
+                const char* msg = lua.tolstring(L, -1, NULL);
+                std::cerr << "LuaAsio worker: "
+                    << (msg ? msg : "(non-string error)") << "\n";
+            }
+            lua.close(L);
+            delete svr;
+        }
+        // The pool posts the stop here, so stay until it arrives.
+        while (!loop.stopping) {
+            loop.io.restart();
+            loop.io.run_one();
+        }
     }
 
 public:
+    worker_pool(asio_loop& loop, const asio::ip::address& ip, int port)
+        : _ip(ip), _port(port), _hold(asio::make_work_guard(loop.io))
+    {
+    }
 
-    int port;
+    ~worker_pool() {
+        for (auto &w : _workers) {
+            asio_loop* loop = w.loop;
+            if (loop)
+                asio::post(loop->io, [loop]() { loop->stopping = true; });
+        }
+        for (auto &w : _workers)
+            w.thread.join();
+    }
 
-    server(asio::io_context& io_context,
-        const asio::ip::address &ip, int port)
-        : port(port),
-          _acceptor(io_context, tcp::endpoint(ip, port)
-#ifdef _WINDOWS
-          , false
-#endif
-          )
-    {
-        do_accept();
+    void set_option(int opt, int value) {
+        _options.push_back(make_pair(opt, value));
     }
 
+    // Returns false when the Lua API is missing or a thread could not
+    // listen on the port.
+    bool start(int count, const char* boot, size_t boot_len,
+        const char** args, const size_t* arg_lens, int nargs)
+    {
+        static lua_api lua;
+        static bool loaded = false;
+        static std::once_flag once;
+        std::call_once(once, []() { loaded = lua.load(); });
+        if (!loaded)
+            return false;
+        _boot.assign(boot, boot_len);
+        for (int i = 0; i < nargs; ++i)
+            _args.push_back(string(args[i], arg_lens[i]));
+        _workers.resize(count);
+        for (auto &w : _workers)
+            w.thread = std::thread(&worker_pool::run, this, &w, lua);
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [this]() {
+            return _started == (int)_workers.size();
+        });
+        return !_failed;
+    }
 };
 
+#endif
+
 // class udp_socket : public boost::enable_shared_from_this<udp_socket>
 // {
 // private:
@@ -285,7 +3257,17 @@ public:
 
 //--------------------------api--------------------------
 
-asio::io_context io_context;
+extern "C"
+DLL_EXPORT asio_loop* asio_new_loop() {
+    return new asio_loop();
+}
+
+extern "C"
+DLL_EXPORT void asio_delete_loop(asio_loop* loop) {
+    delete loop;
+}
+
+//----------------------
 
 extern "C"
 DLL_EXPORT void asio_delete_server(void* p) {
@@ -293,8 +3275,18 @@ DLL_EXPORT void asio_delete_server(void* p) {
     delete svr;
 }
 
+// Returns false for an unknown option name.
+extern "C"
+DLL_EXPORT bool asio_server_setopt(void* p, const char* name, int value) {
+    int opt = server_option_of(name);
+    if (opt < 0)
+        return false;
+    ((server*)p)->set_option(opt, value);
+    return true;
+}
+
 extern "C"
-DLL_EXPORT void* asio_new_server(const char* ip, int port) {
+DLL_EXPORT void* asio_new_server(asio_loop* loop, const char* ip, int port) {
     asio::ip::address ip_addr;
     try {
         ip_addr = asio::ip::address::from_string(ip);
@@ -303,7 +3295,7 @@ DLL_EXPORT void* asio_new_server(const char* ip, int port) {
     }
 
     try {
-        auto svr = new server(io_context, ip_addr, port);
+        auto svr = new server(*loop, ip_addr, port);
         return svr;
     } catch (std::exception& e) {
         std::cerr << "LuaAsio Exception new_server: " << e.what() << "\n";
@@ -311,24 +3303,71 @@ DLL_EXPORT void* asio_new_server(const char* ip, int port) {
     }
 }
 
+extern "C"
+DLL_EXPORT void* asio_new_workers(asio_loop* loop, const char* ip, int port) {
+#ifndef _WINDOWS
+    asio::ip::address ip_addr;
+    try {
+        ip_addr = asio::ip::address::from_string(ip);
+    } catch (...) {
+        return NULL;
+    }
+    return new worker_pool(*loop, ip_addr, port);
+#else
+    return NULL;
+#endif
+}
+
+// Returns false for an unknown option name.
+extern "C"
+DLL_EXPORT bool asio_workers_setopt(void* p, const char* name, int value) {
+#ifndef _WINDOWS
+    int opt = server_option_of(name);
+    if (opt < 0)
+        return false;
+    ((worker_pool*)p)->set_option(opt, value);
+    return true;
+#else
+    return false;
+#endif
+}
+
+extern "C"
+DLL_EXPORT bool asio_workers_start(void* p, int count, const char* boot,
+    size_t boot_len, const char** args, const size_t* arg_lens, int nargs)
+{
+#ifndef _WINDOWS
+    return ((worker_pool*)p)->start(count, boot, boot_len, args, arg_lens,
+        nargs);
+#else
+    return false;
+#endif
+}
+
+extern "C"
+DLL_EXPORT void asio_delete_workers(void* p) {
+#ifndef _WINDOWS
+    delete (worker_pool*)p;
+#endif
+}
+
 //----------------------
 
 extern "C"
-DLL_EXPORT void asio_delete_connection(void* p) {
-    auto conn = (connection::pointer*)p;
-    delete conn;
+DLL_EXPORT void asio_delete_connection(asio_loop* loop, conn_handle h) {
+    loop->handles.remove(h);
 }
 
 extern "C"
-DLL_EXPORT void* asio_new_connect(const char* host, u_short port,
-     int dest_id, bool v6)
+DLL_EXPORT conn_handle asio_new_connect(asio_loop* loop, const char* host,
+    u_short port, int dest_id, bool v6, double timeout)
 {
     tcp::endpoint ep;
     try {
         ep = tcp::endpoint(
             asio::ip::address::from_string(host), port);
     } catch (...) {
-        tcp::resolver resolver(io_context);
+        tcp::resolver resolver(loop->io);
         auto r = resolver.resolve(host, std::to_string(port).c_str());
         for (auto i = r.begin(); i != r.end(); ++i){
             ep = i->endpoint();
@@ -336,9 +3375,7 @@ DLL_EXPORT void* asio_new_connect(const char* host, u_short port,
                 break;
         }
     }
-    auto conn = new boost::shared_ptr<connection>(
-        new connection(io_context, ep, dest_id));
-    return conn;
+    return loop->handles.add(new connection(*loop, ep, dest_id, timeout));
 }
 
 // extern "C"
@@ -384,8 +3421,8 @@ void get_addr_ip_port(sockaddr_storage* addr,
 }
 
 extern "C"
-DLL_EXPORT const char* asio_addr_to_str(const char* p) {
-    static std::string rtn;
+DLL_EXPORT const char* asio_addr_to_str(asio_loop* loop, const char* p) {
+    std::string &rtn = loop->text;
     auto addr = (sockaddr_storage*)p;
     asio::ip::address ip;
     u_short port;
@@ -396,118 +3433,431 @@ DLL_EXPORT const char* asio_addr_to_str(const char* p) {
 }
 
 extern "C"
-DLL_EXPORT void* asio_new_connect_sockaddr(const char* p, int dest_id) {
+DLL_EXPORT conn_handle asio_new_connect_sockaddr(asio_loop* loop,
+    const char* p, int dest_id, double timeout)
+{
     auto addr = (sockaddr_storage*)p;
     asio::ip::address ip;
     u_short port;
     get_addr_ip_port(addr, ip, port);
     tcp::endpoint ep(ip, port);
-    auto conn = new boost::shared_ptr<connection>(
-        new connection(io_context, ep, dest_id));
-    return conn;
+    return loop->handles.add(new connection(*loop, ep, dest_id, timeout));
+}
+
+extern "C"
+DLL_EXPORT bool asio_conn_read(asio_loop* loop, conn_handle h, size_t size,
+    int dest_id, double timeout, event_message_for_ffi* out)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return fail_now(out, bad_handle());
+    return conn->read(size, dest_id, timeout, out);
+}
+
+extern "C"
+DLL_EXPORT bool asio_conn_read_some(asio_loop* loop, conn_handle h,
+    int dest_id, double timeout, event_message_for_ffi* out)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return fail_now(out, bad_handle());
+    return conn->read_some(dest_id, timeout, out);
+}
+
+extern "C"
+DLL_EXPORT bool asio_conn_read_until(asio_loop* loop, conn_handle h,
+    const char* delim, size_t delim_len, size_t max, int dest_id,
+    double timeout, event_message_for_ffi* out)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return fail_now(out, bad_handle());
+    return conn->read_until(delim, delim_len, max, dest_id, timeout, out);
+}
+
+extern "C"
+DLL_EXPORT void asio_conn_set_read_wait(asio_loop* loop, conn_handle h,
+    bool on)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return;
+    conn->set_read_wait(on);
+}
+
+extern "C"
+DLL_EXPORT void asio_conn_set_read_size(asio_loop* loop, conn_handle h,
+    size_t min, size_t max)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return;
+    conn->set_read_size(min, max);
+}
+
+extern "C"
+DLL_EXPORT void asio_conn_set_read_ahead(asio_loop* loop, conn_handle h,
+    size_t size)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return;
+    conn->set_read_ahead(size);
+}
+
+// Returns false for an unknown kind or an invalid key or IV.
+extern "C"
+DLL_EXPORT bool asio_conn_add_transform(asio_loop* loop, conn_handle h,
+    bool write, const char* kind, const char* key, size_t key_len,
+    const char* iv, size_t iv_len)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return false;
+    stream_transform* t = make_transform(kind, key, key_len, iv, iv_len,
+        write);
+    if (!t)
+        return false;
+    conn->add_transform(write, t);
+    return true;
+}
+
+extern "C"
+DLL_EXPORT void asio_conn_set_aead(asio_loop* loop, conn_handle h,
+    const char* send_key, const char* recv_key)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return;
+    conn->set_aead(send_key, recv_key);
+}
+
+extern "C"
+DLL_EXPORT bool asio_conn_read_frame(asio_loop* loop, conn_handle h,
+    int dest_id, double timeout, event_message_for_ffi* out)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return fail_now(out, bad_handle());
+    return conn->read_frame(dest_id, timeout, out);
+}
+
+extern "C"
+DLL_EXPORT int asio_conn_write_frame(asio_loop* loop, conn_handle h,
+    const char* data, size_t size, int dest_id, double timeout)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return bad_handle();
+    return conn->write_frame(data, size, dest_id, timeout);
+}
+
+extern "C"
+DLL_EXPORT int asio_conn_write(asio_loop* loop, conn_handle h,
+    const char* data, size_t size, int dest_id, double timeout)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return bad_handle();
+    return conn->write(data, size, false, dest_id, timeout);
+}
+
+// Writes memory owned by the caller without copying it. The caller keeps
+// it alive until the completion event, also in pipelined mode.
+extern "C"
+DLL_EXPORT int asio_conn_write_buf(asio_loop* loop, conn_handle h,
+    const void* data, size_t size, int dest_id, double timeout)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return bad_handle();
+    return conn->write((const char*)data, size, true, dest_id, timeout);
+}
+
+extern "C"
+DLL_EXPORT int asio_conn_writev(asio_loop* loop, conn_handle h,
+    const char** datas, const size_t* sizes, int count, int dest_id,
+    double timeout)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return bad_handle();
+    return conn->writev(datas, sizes, count, dest_id, timeout);
 }
 
 extern "C"
-DLL_EXPORT void asio_conn_read(void* p, size_t size, int dest_id) {
-    auto conn = (connection::pointer*)p;
-    (*conn)->read(size, dest_id);
+DLL_EXPORT void asio_conn_set_pipelined(asio_loop* loop, conn_handle h,
+    bool on, size_t high_watermark)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return;
+    conn->set_pipelined(on, high_watermark);
 }
 
 extern "C"
-DLL_EXPORT void asio_conn_read_some(void* p, int dest_id) {
-    auto conn = (connection::pointer*)p;
-    (*conn)->read_some(dest_id);
+DLL_EXPORT int asio_conn_flush(asio_loop* loop, conn_handle h, int dest_id,
+    double timeout)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return bad_handle();
+    return conn->flush(dest_id, timeout);
 }
 
 extern "C"
-DLL_EXPORT void asio_conn_write(void* p, const char* data,
-    size_t size, int dest_id)
+DLL_EXPORT void asio_forward(asio_loop* loop, conn_handle a, conn_handle b,
+    bool both, int dest_id)
 {
-    auto conn = (connection::pointer*)p;
-    (*conn)->write(std::move(string(data, size)), dest_id);
+    connection* from = loop->handles.get(a);
+    connection* to = loop->handles.get(b);
+    if (!from || !to) {
+        uint64_t bytes[2] = { 0, 0 };
+        push_event_inline(loop->events, EVT_CONTINUE, dest_id, NULL,
+            bad_handle(), bytes, sizeof(bytes));
+        return;
+    }
+    auto fwd = boost::shared_ptr<forwarder>(new forwarder(
+        connection::pointer(from), connection::pointer(to), both, dest_id));
+    fwd->start();
+}
+
+extern "C"
+DLL_EXPORT void asio_conn_close(asio_loop* loop, conn_handle h) {
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return;
+    conn->close();
 }
 
+// Returns 0, the error, or -1 for an unknown option name.
 extern "C"
-DLL_EXPORT void asio_conn_close(void* p) {
-    auto conn = (connection::pointer*)p;
-    (*conn)->close();
+DLL_EXPORT int asio_conn_setopt(asio_loop* loop, conn_handle h,
+    const char* name, int value)
+{
+    int opt = socket_option_of(name);
+    if (opt < 0)
+        return -1;
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return bad_handle();
+    return conn->setopt(opt, value);
 }
 
 extern "C"
-DLL_EXPORT void* asio_get_original_dst(void* p) {
-    auto conn = (connection::pointer*)p;
-    static sockaddr_storage rtn;
-    if ((*conn)->get_original_dst(&rtn))
-        return &rtn;
+DLL_EXPORT void* asio_get_original_dst(asio_loop* loop, conn_handle h) {
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return NULL;
+    if (conn->get_original_dst(&loop->addr))
+        return &loop->addr;
     else
         return NULL;
 }
 
 //----------------------
 
+// The same name returns the same channel in every Lua state; `capacity`,
+// rounded up to a power of two, counts when the channel is created.
 extern "C"
-DLL_EXPORT void asio_sleep(int dest_id, double sec) {
-    auto timer = boost::shared_ptr<asio::deadline_timer>(
-        new asio::deadline_timer(
-            io_context,
-            boost::posix_time::millisec((int64_t)(sec * 1000))
-        ));
-    timer->async_wait(
-        [timer, dest_id](const asio::error_code& ec)
-        {
-            if (!ec) {
-                push_event(EVT_CONTINUE, dest_id, NULL, "");
-            }else{
-                push_event(EVT_CONTINUE, dest_id, NULL, ec.message());
-            }
-        });
+DLL_EXPORT void* asio_channel_open(const char* name, size_t capacity) {
+    static channel_registry registry;
+    return registry.open(name, capacity);
 }
 
 extern "C"
-DLL_EXPORT bool asio_stopped() {
-    return io_context.stopped();
+DLL_EXPORT void asio_channel_detach(asio_loop* loop, void* p) {
+    ((channel*)p)->detach(*loop);
 }
 
+// Returns 0, or ENOBUFS when the channel is full.
 extern "C"
-struct event_message_for_ffi {
-    char type;
-    int dest_id;
-    void* source;
-    const char* data;
-    size_t data_len;
-};
+DLL_EXPORT int asio_channel_send(void* p, const char* data, size_t size) {
+    channel_message msg = {};
+    msg.buf = heap_buffer(size);
+    msg.size = size;
+    memcpy(msg.buf->data(), data, size);
+    if (((channel*)p)->send(msg))
+        return 0;
+    free(msg.buf);
+    return error_code_of(asio::error::no_buffer_space);
+}
+
+// Moves the socket of `h` to whichever loop receives it and frees `h`. When
+// the channel is full `h` keeps its socket.
+extern "C"
+DLL_EXPORT int asio_channel_send_conn(asio_loop* loop, void* p,
+    conn_handle h)
+{
+    connection* conn = loop->handles.get(h);
+    if (!conn)
+        return bad_handle();
+    channel_message msg = {};
+    auto ec = conn->release_socket(msg.fd, msg.v6);
+    if (ec)
+        return error_code_of(ec);
+    if (!((channel*)p)->send(msg)) {
+        conn->restore_socket(msg.fd, msg.v6);
+        return error_code_of(asio::error::no_buffer_space);
+    }
+    loop->handles.remove(h);
+    return 0;
+}
+
+// Fills `out` and returns true when a message was ready, or on error. A
+// string comes as data. A connection comes as its handle in data, with the
+// channel as `source`.
+extern "C"
+DLL_EXPORT bool asio_channel_recv(asio_loop* loop, void* p, int dest_id,
+    event_message_for_ffi* out)
+{
+    auto ch = (channel*)p;
+    channel_message msg;
+    std::error_code ec;
+    if (!ch->recv(*loop, dest_id, msg, ec))
+        return ec ? fail_now(out, error_code_of(ec)) : false;
+    int err;
+    conn_handle handle = adopt_message(*loop, msg, err);
+    if (err)
+        return fail_now(out, err);
+    if (!msg.buf) {
+        return complete_now(out, ch, ch->hold(handle),
+            sizeof(conn_handle));
+    }
+    ch->hold(msg.buf);
+    return complete_now(out, NULL, msg.buf->data(), msg.size);
+}
+
+//----------------------
+
+void sleep_done(void* arg, int dest_id) {
+    push_event(((asio_loop*)arg)->events, EVT_CONTINUE, dest_id, NULL);
+}
+
+extern "C"
+DLL_EXPORT void asio_sleep(asio_loop* loop, int dest_id, double sec) {
+    loop->timers.add(sec, sleep_done, loop, dest_id);
+}
 
 extern "C"
-DLL_EXPORT event_message_for_ffi* asio_get(int wait_sec) {
+DLL_EXPORT bool asio_stopped(asio_loop* loop) {
+    return loop->stopping || loop->io.stopped();
+}
+
+// Runs every ready handler (blocking for the first one only when the queue
+// is empty), then pops up to `max` queued events into `events`. The data
+// pointers stay valid until the next call. Returns the number of events.
+extern "C"
+DLL_EXPORT int asio_get_batch(asio_loop* loop, event_message_for_ffi* events,
+    int max, int wait_sec)
+{
+    auto &queue = loop->events;
+    auto &io = loop->io;
+    queue.release();
+    loop->views.clear();
+    if (loop->stopping)
+        return 0;
     try {
-        if (g_evt_queue.empty()) {
-            if(io_context.stopped()){
-                io_context.restart();
+        if (queue.empty()) {
+            if(io.stopped()){
+                io.restart();
             }
             if (wait_sec < 0) {
-                io_context.run_one();
+                io.run_one();
             } else {
-                io_context.run_one_for(chrono::seconds(wait_sec));
-            }
-        }
-        if (g_evt_queue.empty()) return NULL;
-
-        static string buff;
-        static event_message_for_ffi rtn;
-        auto &evt    = g_evt_queue.front();
-        rtn.type     = evt.type;
-        rtn.dest_id  = evt.dest_id;
-        rtn.source   = evt.source;
-        buff         = evt.data;
-        rtn.data     = buff.c_str();
-        rtn.data_len = buff.size();
-        g_evt_queue.pop_front();
-        return &rtn;
+                io.run_one_for(chrono::seconds(wait_sec));
+            }
+        }
+        io.poll();
+
+        int n = 0;
+        while (n < max && !queue.empty()) {
+            auto &evt    = queue.pop();
+            auto &rtn    = events[n++];
+            rtn.type     = evt.type;
+            rtn.dest_id  = evt.dest_id;
+            rtn.err      = evt.err;
+            rtn.source   = evt.source;
+            rtn.data     = evt.data ? evt.data : evt.inline_data;
+            rtn.data_len = evt.data_len;
+        }
+        return n;
     } catch (std::exception& e) {
         std::cerr << "LuaAsio Exception: " << e.what() << "\n";
-        return NULL;
+        return 0;
     }
 }
 
+extern "C"
+DLL_EXPORT const char* asio_strerror(asio_loop* loop, int code) {
+    loop->text = error_code_from(code).message();
+    return loop->text.c_str();
+}
+
+extern "C"
+struct error_const_for_ffi {
+    const char* name;
+    int code;
+};
+
+extern "C"
+DLL_EXPORT const error_const_for_ffi* asio_error_consts(int* count) {
+    static const error_const_for_ffi consts[] = {
+        { "EOF",            error_code_of(asio::error::eof) },
+        { "ECANCELED",      error_code_of(asio::error::operation_aborted) },
+        { "ECONNRESET",     error_code_of(asio::error::connection_reset) },
+        { "ECONNREFUSED",   error_code_of(asio::error::connection_refused) },
+        { "ECONNABORTED",   error_code_of(asio::error::connection_aborted) },
+        { "ETIMEDOUT",      error_code_of(asio::error::timed_out) },
+        { "EPIPE",          error_code_of(asio::error::broken_pipe) },
+        { "EBADF",          error_code_of(asio::error::bad_descriptor) },
+        { "ENOTCONN",       error_code_of(asio::error::not_connected) },
+        { "ESHUTDOWN",      error_code_of(asio::error::shut_down) },
+        { "EHOSTUNREACH",   error_code_of(asio::error::host_unreachable) },
+        { "ENETUNREACH",    error_code_of(asio::error::network_unreachable) },
+        { "EADDRINUSE",     error_code_of(asio::error::address_in_use) },
+        { "EHOSTNOTFOUND",  error_code_of(asio::error::host_not_found) },
+        { "EMSGSIZE",       error_code_of(asio::error::message_size) },
+        { "EBADMSG",        error_code_of(
+            std::make_error_code(std::errc::bad_message)) },
+        { "EOPNOTSUPP",     error_code_of(
+            asio::error::operation_not_supported) },
+        { "ENOBUFS",        error_code_of(asio::error::no_buffer_space) },
+        { "EALREADY",       error_code_of(asio::error::already_started) },
+    };
+    *count = sizeof(consts) / sizeof(consts[0]);
+    return consts;
+}
+
+extern "C"
+struct event_stats_for_ffi {
+    size_t queued;
+    size_t capacity;
+    size_t high_watermark;
+    size_t overflows;
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t accepts;
+    uint64_t accept_wakeups;
+    size_t buffers;
+    uint64_t handler_allocs;
+    uint64_t handler_heap_allocs;
+};
+
+extern "C"
+DLL_EXPORT void asio_get_stats(asio_loop* loop, event_stats_for_ffi* rtn) {
+    rtn->queued         = loop->events.size();
+    rtn->capacity       = loop->events.capacity();
+    rtn->high_watermark = loop->events.high_watermark;
+    rtn->overflows      = loop->events.overflows;
+    rtn->reads          = loop->reads.reads;
+    rtn->read_bytes     = loop->reads.bytes;
+    rtn->accepts        = loop->accepts.accepts;
+    rtn->accept_wakeups = loop->accepts.wakeups;
+    rtn->buffers        = loop->buffers.in_use;
+    rtn->handler_allocs      = loop->handlers.allocs;
+    rtn->handler_heap_allocs = loop->handlers.heap_allocs;
+}
+
 //---------------------------------------------------
 
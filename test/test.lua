@@ -88,12 +88,13 @@ do io.write('---- C Asio Test ----')
     -- not in light thread
     assert( pcall( asio.connect, 'localhost', 1234) == false )
     -- connect faile
-    local con = 'not set con'
+    local con, con_err = 'not set con'
     asio.spawn_light_thread(function()
-        con = asio.connect('0.0.0.1', '1234')
+        con, con_err = asio.connect('0.0.0.1', '1234')
     end)
     asio.run()
     assert(con == nil, con)
+    assert(type(con_err) == 'number' and con_err ~= 0)
 
     -- server
     function connection_th(con)
@@ -121,7 +122,8 @@ do io.write('---- C Asio Test ----')
         -- test read_some err
         local data, err = con:read_some()
         assert(#data == 0)
-        assert(err == 'End of file')
+        assert(err == asio.EOF)
+        assert(asio.strerror(err) == 'End of file')
         -- close and destory
         con:close()
 
@@ -167,7 +169,7 @@ do io.write('---- C Asio Bench ----')
         con:close()
         if i == 2 then
             con_first:close()
-            local c = con_first.cpoint
+            local c = con_first.handle
             con_first = 1
             collectgarbage('collect')
         end
@@ -195,6 +197,792 @@ do io.write('---- C Asio Bench ----')
 
 end io.write(' \t\t[OK]\n')
 
+do io.write('---- Read View Test ----')
+
+    -- views point into the read buffer, no string is made
+    local viewed = {}
+    local s = asio.server('127.0.0.1', 31253, function(con)
+        asio.spawn_light_thread(function()
+            con:write('hello world')
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31253)
+        local ptr, len = con:read_view(5)
+        viewed.head = type(ptr) == 'cdata' and ffi.string(ptr, len)
+        ptr, len = con:read_some_view()
+        viewed.tail = ffi.string(ptr, len)
+        viewed.eof = select(3, con:read_some_view())
+        con:close()
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(viewed.head == 'hello', viewed.head)
+    assert(viewed.tail == ' world', viewed.tail)
+    assert(viewed.eof == asio.EOF, viewed.eof)
+
+end io.write(' \t[OK]\n')
+
+do io.write('---- Timeout Test ----')
+
+    -- timeouts
+    local timeout_err = 'not set'
+    local s = asio.server('127.0.0.1', 31235, function(con)
+        asio.spawn_light_thread(function()
+            local data, err = con:read(5, 5)
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31235, false, 1)
+        local data, err = con:read_some(0.2)
+        timeout_err = err
+        con:close()
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(timeout_err == asio.ETIMEDOUT, timeout_err)
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- Read Until Test ----')
+
+    -- read_until keeps the bytes past the delimiter
+    local lines = {}
+    local s = asio.server('127.0.0.1', 31235, function(con)
+        asio.spawn_light_thread(function()
+            con:write('hello\r\nworld\r\n1234tail')
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31235)
+        lines[1] = con:read_until('\r\n')
+        lines[2] = con:read_until('\r\n')
+        lines[3] = con:read(4)
+        lines[4] = con:read_some()
+        local data, err = con:read_until('\r\n')
+        lines[5] = err
+        con:close()
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(lines[1] == 'hello' and lines[2] == 'world', lines[1])
+    assert(lines[3] == '1234' and lines[4] == 'tail', lines[3])
+    assert(lines[5] == asio.EOF, lines[5])
+
+    -- max bounds the line however its bytes are split into reads
+    local bounded = {}
+    s = asio.server('127.0.0.1', 31235, function(con)
+        asio.spawn_light_thread(function()
+            con:write('hi\r\nabcd\r\n')
+            asio.sleep(0.1)
+            con:write('0123456789\r\n')
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31235)
+        con:set_read_ahead(4096)
+        asio.sleep(0.2)
+        bounded.hi = con:read_until('\r\n', 4)
+        bounded.exact = con:read_until('\r\n', 4)
+        bounded.buffered = select(2, con:read_until('\r\n', 4))
+        con:close()
+        con = asio.connect('127.0.0.1', 31235)
+        con:read_until('\r\n')
+        con:read_until('\r\n')
+        bounded.received = select(2, con:read_until('\r\n', 4))
+        con:close()
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(bounded.hi == 'hi' and bounded.exact == 'abcd', bounded.exact)
+    assert(bounded.buffered == asio.EMSGSIZE, bounded.buffered)
+    assert(bounded.received == asio.EMSGSIZE, bounded.received)
+
+end io.write(' \t[OK]\n')
+
+do io.write('---- Read Ahead Test ----')
+
+    -- read-ahead serves small reads from the buffer
+    local frames = {}
+    local s = asio.server('127.0.0.1', 31235, function(con)
+        asio.spawn_light_thread(function()
+            con:writev({'\0\0\0\5', 'hello', '\0\0\0\3abc'})
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31235)
+        con:set_read_ahead(4096)
+        while true do
+            local head = con:read(4)
+            if not head then break end
+            frames[#frames + 1] = con:read(head:byte(4))
+        end
+        con:close()
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(frames[1] == 'hello' and frames[2] == 'abc', frames[1])
+
+end io.write(' \t[OK]\n')
+
+do io.write('---- Pipeline Test ----')
+
+    -- pipelined writes
+    local echoed = {}
+    local s = asio.server('127.0.0.1', 31235, function(con)
+        asio.spawn_light_thread(function()
+            echoed[1] = con:read(5 * 100)
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31235)
+        con:set_pipelined(64 * 1024)
+        for i = 1, 99 do
+            assert(con:write('ping|'))
+        end
+        local buf = ffi.new('char[5]', 'ping|')
+        assert(con:write_buf(buf, 5))
+        assert(con:flush())
+        con:close()
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(echoed[1] == string.rep('ping|', 100))
+
+end io.write(' \t[OK]\n')
+
+do io.write('---- Forward Test ----')
+
+    -- native forwarding: client <-> relay <-> echo server
+    local relayed = {}
+    local echo = asio.server('127.0.0.1', 31236, function(con)
+        asio.spawn_light_thread(function()
+            while true do
+                local data, err = con:read_some()
+                if #data > 0 then con:write(data) end
+                if err then break end
+            end
+            con:close()
+        end)
+    end)
+    local s = asio.server('127.0.0.1', 31235, function(con)
+        asio.spawn_light_thread(function()
+            local upstream = asio.connect('127.0.0.1', 31236)
+            relayed.ab, relayed.ba, relayed.err = asio.forward(con, upstream)
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31235)
+        local big = string.rep('0123456789', 200000)
+        con:write(big)
+        relayed.echo = con:read(#big) == big
+        con:close()
+        asio.sleep(0.1)
+        asio.destory_server(s)
+        asio.destory_server(echo)
+    end)
+    asio.run()
+    assert(relayed.echo)
+    assert(relayed.ab == 2000000 and relayed.ba == 2000000, relayed.ab)
+    assert(relayed.err == nil, relayed.err)
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- XOR Test ----')
+
+    -- xor transforms: raw bytes on the wire, round trip and forwarding
+    local xored = {}
+    local s = asio.server('127.0.0.1', 31237, function(con)
+        asio.spawn_light_thread(function()
+            xored.raw = con:read(6)
+            con:add_transform('read', 'xor', 'key')
+            con:add_transform('write', 'xor', 'key')
+            local data = con:read(100000)
+            if data then con:write(data) end
+            con:close()
+        end)
+    end)
+    local fwd = asio.server('127.0.0.1', 31238, function(con)
+        asio.spawn_light_thread(function()
+            local upstream = asio.connect('127.0.0.1', 31237)
+            upstream:add_transform('write', 'xor', 'key')
+            upstream:add_transform('read', 'xor', 'key')
+            asio.forward(con, upstream)
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31237)
+        assert(not pcall(con.add_transform, con, 'read', 'nope', 'key'))
+        con:add_transform('write', 'xor', 'key')
+        con:write('hello!')
+        con:close()
+        con = asio.connect('127.0.0.1', 31238)
+        local big = string.rep('abcdefghijklmnopqrstuvwxyz0123456789', 2778)
+        big = big:sub(1, 100000)
+        con:write('hello!')
+        con:write(big)
+        xored.echo = con:read(100000) == big
+        con:close()
+        asio.destory_server(s)
+        asio.destory_server(fwd)
+    end)
+    asio.run()
+    local bit = require 'bit'
+    local expect = {}
+    for i = 1, 6 do
+        expect[i] = string.char(bit.bxor(string.byte('hello!', i),
+            string.byte('key', (i - 1) % 3 + 1)))
+    end
+    assert(xored.raw == table.concat(expect), 'xor on the wire')
+    assert(xored.echo, 'xor round trip')
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- AES Test ----')
+
+    -- aes transforms, checked against the NIST SP 800-38A vectors
+    local function unhex(h)
+        return (h:gsub('..', function(x)
+            return string.char(tonumber(x, 16))
+        end))
+    end
+    local aes_key = unhex('603deb1015ca71be2b73aef0857d7781' ..
+        '1f352c073b6108d72d9810a30914dff4')
+    local ctr_iv = unhex('f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff')
+    local cfb_iv = unhex('000102030405060708090a0b0c0d0e0f')
+    local plain = unhex('6bc1bee22e409f96e93d7e117393172a')
+    local ciphered = {}
+    local s = asio.server('127.0.0.1', 31239, function(con)
+        asio.spawn_light_thread(function()
+            local mode, kind = con:read(1), con:read(11)
+            local iv = kind == 'aes-256-ctr' and ctr_iv or cfb_iv
+            if mode == 'r' then
+                ciphered[kind] = con:read(16)
+            else
+                con:add_transform('read', kind, aes_key, iv)
+                con:add_transform('write', kind, aes_key, iv)
+                local data = con:read(70004)
+                if data then con:write(data) end
+            end
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local big = string.rep('0123456789abcdef', 4375) .. 'tail'
+        for _, kind in ipairs({'aes-256-ctr', 'aes-256-cfb'}) do
+            local iv = kind == 'aes-256-ctr' and ctr_iv or cfb_iv
+            local con = asio.connect('127.0.0.1', 31239)
+            con:write('r' .. kind)
+            assert(not pcall(con.add_transform, con, 'write', kind, 'short'))
+            con:add_transform('write', kind, aes_key, iv)
+            con:write(plain)
+            con:close()
+            con = asio.connect('127.0.0.1', 31239)
+            con:write('e' .. kind)
+            con:add_transform('write', kind, aes_key, iv)
+            con:add_transform('read', kind, aes_key, iv)
+            con:write(big)
+            ciphered[kind .. ' echo'] = con:read(#big) == big
+            con:close()
+        end
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(ciphered['aes-256-ctr'] == unhex('601ec313775789a5b7a7f504bbf3d228'))
+    assert(ciphered['aes-256-cfb'] == unhex('dc7e84bfda79164b7ecd8486985d3860'))
+    assert(ciphered['aes-256-ctr echo'] and ciphered['aes-256-cfb echo'])
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- Frame Test ----')
+
+    -- aead frames: round trip, split of large writes, forged frames
+    local key_a, key_b = string.rep('a', 32), string.rep('b', 32)
+    local framed = {}
+    local s = asio.server('127.0.0.1', 31240, function(con)
+        asio.spawn_light_thread(function()
+            con:set_aead(key_b, key_a)
+            while true do
+                local data, err = con:read_frame()
+                if not data then framed.err = err break end
+                framed[#framed + 1] = #data
+                con:write_frame(data)
+            end
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31240)
+        framed.unset = select(2, con:read_frame())
+        con:set_aead(key_a, key_b)
+        local big = string.rep('x', 40000)
+        con:write_frame('hi')
+        con:write_frame(big)
+        framed.hi = con:read_frame()
+        local parts = {}
+        for i = 1, 3 do parts[i] = con:read_frame() end
+        framed.big = table.concat(parts) == big
+        con:write(string.rep('\0', 40))
+        con:read_some()
+        con:close()
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(framed.hi == 'hi' and framed.big)
+    assert(framed[1] == 2 and framed[2] == 0x3FFF)
+    assert(framed[4] == 40000 - 0x3FFF * 2)
+    assert(framed.err == asio.EBADMSG, framed.err)
+    assert(framed.unset and framed.unset ~= 0)
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- Read Size Test ----')
+
+    -- adaptive read size: grows for bulk transfers, bounded by max
+    local sized = {}
+    local s = asio.server('127.0.0.1', 31241, function(con)
+        asio.spawn_light_thread(function()
+            con:write(string.rep('z', 4 * 1024 * 1024))
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        for _, max in ipairs({4096, 1024 * 1024}) do
+            local con = asio.connect('127.0.0.1', 31241)
+            con:set_read_size(1024, max)
+            local before = asio.stats()
+            local total, largest = 0, 0
+            while true do
+                local data, err = con:read_some()
+                total = total + #data
+                largest = math.max(largest, #data)
+                if err then break end
+            end
+            local after = asio.stats()
+            sized[max] = { total = total, largest = largest,
+                avg = (after.read_bytes - before.read_bytes) /
+                    (after.reads - before.reads) }
+            con:close()
+        end
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(sized[4096].total == 4 * 1024 * 1024)
+    assert(sized[4096].largest <= 4096)
+    assert(sized[1024 * 1024].largest > 16384, sized[1024 * 1024].largest)
+    assert(sized[1024 * 1024].avg > sized[4096].avg)
+
+end io.write(' \t[OK]\n')
+
+do io.write('---- Buffer Pool Test ----')
+
+    -- idle connections return their read buffers to the pool, also when
+    -- the last read was served from buffered bytes
+    local pooled = {}
+    local s = asio.server('127.0.0.1', 31242, function(con)
+        asio.spawn_light_thread(function()
+            con:set_read_ahead(4096)
+            con:read(2)
+            con:read(2)
+            asio.sleep(0.3)
+            con:close()
+        end)
+    end)
+    local conns = {}
+    for i = 1, 100 do
+        asio.spawn_light_thread(function()
+            conns[i] = asio.connect('127.0.0.1', 31242)
+            conns[i]:write('ping')
+        end)
+    end
+    asio.spawn_light_thread(function()
+        asio.sleep(0.15)
+        pooled.idle = asio.stats().buffers
+        asio.sleep(0.3)
+        for i = 1, 100 do conns[i]:close() end
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(pooled.idle < 10, pooled.idle)
+
+end io.write(' \t[OK]\n')
+
+do io.write('---- Read Wait Test ----')
+
+    -- read-wait mode: pending reads pin no buffer
+    local waited = { echoed = 0 }
+    local s = asio.server('127.0.0.1', 31243, function(con)
+        asio.spawn_light_thread(function()
+            con:set_read_wait(true)
+            local data = con:read_some()
+            if data == 'slow' then
+                waited.timeout = select(2, con:read_some(0.05))
+            else
+                con:write(data)
+            end
+            con:close()
+        end)
+    end)
+    for i = 1, 100 do
+        asio.spawn_light_thread(function()
+            local con = asio.connect('127.0.0.1', 31243)
+            asio.sleep(0.2)
+            con:write('ping' .. i)
+            if con:read_some() == 'ping' .. i then
+                waited.echoed = waited.echoed + 1
+            end
+            con:close()
+        end)
+    end
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31243)
+        con:write('slow')
+        asio.sleep(0.1)
+        waited.pending = asio.stats().buffers
+        asio.sleep(0.2)
+        con:close()
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(waited.pending < 10, waited.pending)
+    assert(waited.echoed == 100, waited.echoed)
+    assert(waited.timeout == asio.ETIMEDOUT, waited.timeout)
+
+end io.write(' \t[OK]\n')
+
+do io.write('---- Handler Test ----')
+
+    -- steady-state I/O stores handlers without touching the heap
+    local handlers = {}
+    local s = asio.server('127.0.0.1', 31244, function(con)
+        asio.spawn_light_thread(function()
+            while true do
+                local data, err = con:read_some()
+                if err then break end
+                con:write(data)
+            end
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31244)
+        for i = 1, 20 do
+            con:write('warm' .. i)
+            con:read_some()
+        end
+        local before = asio.stats()
+        for i = 1, 200 do
+            con:write('ping' .. i)
+            assert(con:read_some() == 'ping' .. i)
+        end
+        local after = asio.stats()
+        handlers.allocs = after.handler_allocs - before.handler_allocs
+        handlers.heap = after.handler_heap_allocs - before.handler_heap_allocs
+        con:close()
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(handlers.allocs >= 400, handlers.allocs)
+    assert(handlers.heap == 0, handlers.heap)
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- Handle Test ----')
+
+    -- connections are generation-checked integer handles
+    local stale = {}
+    local s = asio.server('127.0.0.1', 31245, function(con)
+        asio.spawn_light_thread(function()
+            con:read_some()
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31245)
+        local old = con.handle
+        con:close()
+        local new = asio.connect('127.0.0.1', 31245)
+        stale.reused = new.handle ~= old
+        local ghost = setmetatable({ handle = old }, getmetatable(new))
+        stale.data, stale.err = ghost:read_some()
+        stale.write_err = select(2, ghost:write('x'))
+        -- the closed con's proxy must not free its handle a second time
+        con = nil
+        collectgarbage()
+        stale.alive = new:write('bye')
+        new:close()
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(stale.reused)
+    assert(stale.data == '' and stale.err == asio.EBADF, stale.err)
+    assert(stale.write_err == asio.EBADF, stale.write_err)
+    assert(stale.alive)
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- Option Test ----')
+
+    -- socket options, per connection and as server defaults
+    local opts = {}
+    local s = asio.server('127.0.0.1', 31246, function(con)
+        asio.spawn_light_thread(function()
+            con:write(con:read_some())
+            con:close()
+        end)
+    end, { nodelay = true, sndbuf = 262144, keepalive = true })
+    assert(not pcall(asio.server, '127.0.0.1', 31247, print, { bogus = 1 }))
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31246, nil, nil,
+            { nodelay = true, rcvbuf = 262144 })
+        opts.keepalive = con:setopt('keepalive', true) and
+            con:setopt('keepalive_idle', 30) and
+            con:setopt('keepalive_interval', 5) and
+            con:setopt('keepalive_count', 3)
+        opts.cork = con:setopt('cork', true)
+        con:write('corked')
+        opts.uncork = con:setopt('cork', false)
+        opts.quickack = con:setopt('quickack', true)
+        opts.lowat = con:setopt('notsent_lowat', 16384)
+        opts.unknown = pcall(con.setopt, con, 'bogus', 1)
+        opts.echo = con:read_some()
+        con:close()
+        opts.closed = select(2, con:setopt('nodelay', true))
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(opts.keepalive and opts.cork and opts.uncork)
+    if ffi.os == 'Linux' then
+        assert(opts.quickack and opts.lowat)
+    end
+    assert(opts.unknown == false)
+    assert(opts.echo == 'corked', opts.echo)
+    assert(opts.closed == asio.EBADF, opts.closed)
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- Worker Test ----')
+
+    -- multi-threaded server: each thread runs its own Lua state, so the
+    -- handler brings its upvalues itself and may not have any
+    local ok, err = pcall(asio.server, '127.0.0.1', 31248, function(con)
+        asio.spawn_light_thread(function() con:close() end)
+    end, { threads = 2 })
+    assert(not ok and err:find('upvalue asio', 1, true), err)
+    local threaded = { echoed = 0, states = {}, count = 0 }
+    local s = asio.server('127.0.0.1', 31248, function(con)
+        local asio = require 'asio'
+        asio.spawn_light_thread(function()
+            local data = con:read_some()
+            con:write(data .. '@' .. tostring(asio))
+            con:close()
+        end)
+    end, { threads = 4, nodelay = true })
+    assert(s)
+    for i = 1, 64 do
+        asio.spawn_light_thread(function()
+            local con = asio.connect('127.0.0.1', 31248)
+            con:write('t' .. i)
+            local echo, state = con:read_some():match('^(t%d+)@(.*)$')
+            if echo == 't' .. i then
+                threaded.echoed = threaded.echoed + 1
+            end
+            if state ~= tostring(asio) and not threaded.states[state] then
+                threaded.states[state] = true
+                threaded.count = threaded.count + 1
+            end
+            con:close()
+            if threaded.echoed == 64 then
+                asio.destory_server(s)
+            end
+        end)
+    end
+    asio.run()
+    assert(threaded.echoed == 64, threaded.echoed)
+    assert(threaded.count > 1, threaded.count)
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- Loop Test ----')
+
+    -- a second loop in the same thread keeps its own events and handles
+    local ok, lib = pcall(ffi.load, 'asio')
+    if not ok then lib = ffi.load('./libasio.so') end
+    local other = lib.asio_new_loop()
+    local osv = lib.asio_new_server(other, '127.0.0.1', 31249)
+    assert(osv ~= nil)
+    local ocon
+    asio.spawn_light_thread(function()
+        ocon = asio.connect('127.0.0.1', 31249)
+    end)
+    while not ocon do asio.run_once(1) end
+    local evts = ffi.new('event_message[1]')
+    while lib.asio_get_batch(other, evts, 1, 1) == 0 do end
+    assert(evts[0].type == 1 and evts[0].dest_id == 31249)
+    local oh = tonumber(ffi.cast('const conn_handle*', evts[0].data)[0])
+    assert(oh > 0)
+    lib.asio_delete_connection(other, oh)
+    -- a connect outlives its deleted handle until it completes
+    local ch = lib.asio_new_connect(other, '127.0.0.1', 31249, 77, false, 0)
+    lib.asio_delete_connection(other, ch)
+    while lib.asio_get_batch(other, evts, 1, 1) == 0 do end
+    assert(evts[0].type == 2 and evts[0].dest_id == 77)
+    lib.asio_delete_server(osv)
+    lib.asio_delete_loop(other)
+    ocon:close()
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- Channel Test ----')
+
+    -- channels: a parked receiver is woken, a full channel refuses, and
+    -- connections move from the threads of a server to this state
+    local ch = asio.channel('test.chan', 2)
+    local got = {}
+    asio.spawn_light_thread(function()
+        for i = 1, 3 do got[i] = ch:recv() end
+    end)
+    assert(#got == 0)
+    assert(ch:send('a') and ch:send('b'))
+    local ok, err = ch:send('c')
+    assert(not ok and err == asio.ENOBUFS)
+    asio.spawn_light_thread(function()
+        local ok, err = ch:recv()
+        assert(not ok and err == asio.EALREADY)
+    end)
+    while #got < 2 do asio.run_once(1) end
+    assert(got[1] == 'a' and got[2] == 'b')
+    assert(ch:send('c'))
+    while #got < 3 do asio.run_once(1) end
+    assert(got[3] == 'c')
+
+    local s = asio.server('127.0.0.1', 31250, function(con)
+        require('asio').channel('test.accepted'):send(con)
+    end, { threads = 2 })
+    assert(s)
+    local accepted = asio.channel('test.accepted')
+    local moved = 0
+    asio.spawn_light_thread(function()
+        for i = 1, 8 do
+            local con = accepted:recv()
+            con:write('moved')
+            con:close()
+        end
+    end)
+    for i = 1, 8 do
+        asio.spawn_light_thread(function()
+            local con = asio.connect('127.0.0.1', 31250)
+            if con:read(5) == 'moved' then
+                moved = moved + 1
+            end
+            con:close()
+            if moved == 8 then
+                asio.destory_server(s)
+            end
+        end)
+    end
+    asio.run()
+    assert(moved == 8, moved)
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- Accept Batch Test ----')
+
+    -- batched accept drains a burst of connections per wakeup
+    local batched = 0
+    local before = asio.stats()
+    local s = asio.server('127.0.0.1', 31251, function(con)
+        asio.spawn_light_thread(function()
+            con:write(con:read(2))
+            con:close()
+        end)
+    end, { backlog = 256, accept_batch = 16 })
+    assert(s)
+    for i = 1, 48 do
+        asio.spawn_light_thread(function()
+            local con = asio.connect('127.0.0.1', 31251)
+            con:write('ab')
+            if con:read(2) == 'ab' then
+                batched = batched + 1
+            end
+            con:close()
+            if batched == 48 then
+                asio.destory_server(s)
+            end
+        end)
+    end
+    asio.run()
+    assert(batched == 48, batched)
+    local after = asio.stats()
+    local accepts = after.accepts - before.accepts
+    local wakeups = after.accept_wakeups - before.accept_wakeups
+    assert(accepts == 48, accepts)
+    assert(wakeups < accepts, wakeups)
+
+end io.write(' \t[OK]\n')
+
+do io.write('---- Writer Test ----')
+
+    -- one writer at a time: while a light thread waits in a write, other
+    -- writes on the connection fail with EALREADY, plain and pipelined
+    local writers = {}
+    local big = string.rep('w', 16 * 1024 * 1024)
+    local s = asio.server('127.0.0.1', 31252, function(con)
+        asio.spawn_light_thread(function()
+            asio.sleep(0.2)
+            local first = con:read(#big + 1)
+            asio.sleep(0.2)
+            local second = con:read(#big + 1)
+            con:write(first and second and 'ok' or 'ko')
+            con:close()
+        end)
+    end)
+    asio.spawn_light_thread(function()
+        local con = asio.connect('127.0.0.1', 31252)
+        asio.spawn_light_thread(function()
+            asio.sleep(0.05)
+            writers.second = select(2, con:write('x'))
+            writers.flush = select(2, con:flush())
+        end)
+        writers.first = con:write(big)
+        writers.retry = con:write('x')
+        con:set_pipelined(65536)
+        asio.spawn_light_thread(function()
+            asio.sleep(0.05)
+            writers.queued = select(2, con:write('y'))
+        end)
+        writers.pipelined = con:write(big) and con:write('y') and
+            con:flush()
+        writers.reply = con:read(2)
+        con:close()
+        asio.destory_server(s)
+    end)
+    asio.run()
+    assert(writers.first and writers.retry and writers.pipelined)
+    assert(writers.second == asio.EALREADY, writers.second)
+    assert(writers.flush == asio.EALREADY, writers.flush)
+    assert(writers.queued == asio.EALREADY, writers.queued)
+    assert(writers.reply == 'ok', writers.reply)
+
+end io.write(' \t\t[OK]\n')
+
+do io.write('---- Stats Test ----')
+
+    local st = asio.stats()
+    assert(st.queued == 0)
+    assert(st.high_watermark > 0 and st.high_watermark <= st.capacity)
+    assert(st.overflows == 0)
+    assert(st.reads > 0 and st.avg_read_bytes > 0)
+
+end io.write(' \t\t[OK]\n')
+
+
 --tproxy test
 if ffi.os ~= "Windows" then io.write('---- REDIRECT Test ----')
 